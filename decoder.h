@@ -23,6 +23,11 @@ struct _Decoder
             unsigned char **out_buf,
             unsigned char *in_buf,
             int buf_size);
+    int (*split)(Decoder *thiz,
+            const unsigned char **header,
+            int *header_size,
+            unsigned char *in_buf,
+            int buf_size);
     void (*destroy)(Decoder *thiz);
 
     char priv[];
@@ -38,6 +43,23 @@ static inline int decoder_decode(Decoder *thiz,
     return thiz->decode(thiz, out_buf, in_buf, buf_size);
 }
 
+/*
+ * Split a frame into a rewritten header and the untouched scan payload
+ * starting at the returned offset of in_buf. The header is owned by the
+ * decoder and stays valid until the next call. Returns 0 if the frame
+ * can be used as is.
+ */
+static inline int decoder_split(Decoder *thiz,
+        const unsigned char **header,
+        int *header_size,
+        unsigned char *in_buf,
+        int buf_size)
+{
+    assert(thiz != NULL && thiz->split != NULL);
+
+    return thiz->split(thiz, header, header_size, in_buf, buf_size);
+}
+
 static inline void decoder_destroy(Decoder *thiz)
 {
     assert(thiz != NULL && thiz->destroy != NULL);
@@ -13,12 +13,13 @@
 #include "decoder.h"
 #include "decoder_mjpeg.h"
 
-static int is_huffman(unsigned char *buf)
+static int is_huffman(unsigned char *buf, int buf_size)
 {
     int i = 0;
     unsigned char *pbuf = buf;
+    unsigned char *plimit = buf + buf_size - 1;
 
-    while (((pbuf[0] << 8) | pbuf[1]) != 0xffda)
+    while ( (pbuf < plimit) && (((pbuf[0] << 8) | pbuf[1]) != 0xffda) )
     {
         if (i++ > 2048)
         {
@@ -36,84 +37,183 @@ static int is_huffman(unsigned char *buf)
     return 0;
 }
 
-static int decoder_mjpeg_decode(Decoder *thiz, 
-        unsigned char **out_buf, 
-        unsigned char *in_buf,
-        int buf_size)
+typedef struct _PrivInfo
+{
+    /* bytes before SOS as received, used to revalidate the cache */
+    unsigned char *raw;
+    int raw_size;
+
+    /* raw bytes with the huffman table inserted before SOF0 */
+    unsigned char *header;
+    int header_size;
+} PrivInfo;
+
+static int header_match(PrivInfo *priv, unsigned char *in_buf, int buf_size)
+{
+    int n = priv->raw_size;
+
+    if (n == 0 || n + 2 > buf_size)
+    {
+        return 0;
+    }
+
+    /* cheap reject first: SOS must sit where it did in the cached frame */
+    if (in_buf[n] != 0xff || in_buf[n + 1] != 0xda)
+    {
+        return 0;
+    }
+
+    return memcmp(in_buf, priv->raw, n) == 0;
+}
+
+static int header_rebuild(PrivInfo *priv, unsigned char *in_buf, int buf_size)
 {
-    int pos = 0;
-    int size_start = 0;
-    unsigned char *pdeb = in_buf;
+    int sof = 0;
+    int sos = 0;
     unsigned char *pcur = in_buf;
-    unsigned char *plimit = in_buf + buf_size;
-    unsigned char *jpeg_buf;
+    unsigned char *plimit = in_buf + buf_size - 1;
+    unsigned char *buf;
+
+    priv->raw_size = 0;
+    priv->header_size = 0;
 
-    if (is_huffman(in_buf))
+    if (is_huffman(in_buf, buf_size))
     {
 #ifdef DECODER_DEBUG
         printf("huffman\n");
 #endif
+        return 0;
     }
-    else
-    {
+
 #ifdef DECODER_DEBUG
-        printf("no huffman\n");
+    printf("no huffman\n");
 #endif
 
-        /* find the SOF0(Start Of Frame 0) of JPEG */
-        while ( (((pcur[0] << 8) | pcur[1]) != 0xffc0) && (pcur < plimit) )
-        {
-            pcur++;
-        }
+    /* find the SOF0(Start Of Frame 0) of JPEG */
+    while ( (pcur < plimit) && (((pcur[0] << 8) | pcur[1]) != 0xffc0) )
+    {
+        pcur++;
+    }
+    sof = pcur - in_buf;
+
+    /* then the SOS(Start Of Scan) following it */
+    while ( (pcur < plimit) && (((pcur[0] << 8) | pcur[1]) != 0xffda) )
+    {
+        pcur++;
+    }
+    sos = pcur - in_buf;
+
+    if (pcur >= plimit)
+    {
+        return 0;
+    }
 
-        /* SOF0 of JPEG exist */
-        if (pcur < plimit)
-        {
 #ifdef DECODER_DEBUG
-            printf("SOF0 existed at position\n");
+    printf("rebuild header, SOF0 at %d, SOS at %d\n", sof, sos);
 #endif
-            jpeg_buf = malloc(buf_size + sizeof(dht_data) + 10);
 
-            if (jpeg_buf != NULL)
-            {
-                /* insert huffman table after SOF0 */
-                size_start = pcur - pdeb;
-                memcpy(jpeg_buf, in_buf, size_start);
-                pos += size_start;
+    buf = realloc(priv->raw, sos);
+    if (buf == NULL)
+    {
+        return 0;
+    }
+    priv->raw = buf;
 
-                memcpy(jpeg_buf + pos, dht_data, sizeof(dht_data));
-                pos += sizeof(dht_data);
+    buf = realloc(priv->header, sos + sizeof(dht_data));
+    if (buf == NULL)
+    {
+        return 0;
+    }
+    priv->header = buf;
 
-                memcpy(jpeg_buf + pos, pcur, buf_size - size_start);
-                pos += buf_size - size_start;
+    memcpy(priv->raw, in_buf, sos);
 
-                *out_buf = jpeg_buf;
+    /* insert huffman table after SOF0 */
+    memcpy(priv->header, in_buf, sof);
+    memcpy(priv->header + sof, dht_data, sizeof(dht_data));
+    memcpy(priv->header + sof + sizeof(dht_data), in_buf + sof, sos - sof);
 
-                /* Caller must free the buffer. */
-                /* free(jpeg_buf);
-                jpeg_buf = NULL; */
-            }
-        }
+    priv->raw_size = sos;
+    priv->header_size = sos + sizeof(dht_data);
+
+    return sos;
+}
+
+static int decoder_mjpeg_split(Decoder *thiz,
+        const unsigned char **header,
+        int *header_size,
+        unsigned char *in_buf,
+        int buf_size)
+{
+    PrivInfo *priv = (PrivInfo *)thiz->priv;
+
+    if (!header_match(priv, in_buf, buf_size)
+        && !header_rebuild(priv, in_buf, buf_size))
+    {
+        return 0;
+    }
+
+    *header = priv->header;
+    *header_size = priv->header_size;
+
+    return priv->raw_size;
+}
+
+static int decoder_mjpeg_decode(Decoder *thiz, 
+        unsigned char **out_buf, 
+        unsigned char *in_buf,
+        int buf_size)
+{
+    int offset;
+    int header_size = 0;
+    const unsigned char *header = NULL;
+    unsigned char *jpeg_buf;
+
+    offset = decoder_mjpeg_split(thiz, &header, &header_size,
+            in_buf, buf_size);
+    if (offset == 0)
+    {
+        return 0;
+    }
+
+    jpeg_buf = malloc(header_size + buf_size - offset);
+    if (jpeg_buf == NULL)
+    {
+        return 0;
     }
 
-    return pos;
+    memcpy(jpeg_buf, header, header_size);
+    memcpy(jpeg_buf + header_size, in_buf + offset, buf_size - offset);
+
+    /* Caller must free the buffer. */
+    *out_buf = jpeg_buf;
+
+    return header_size + buf_size - offset;
 }
 
 static void decoder_mjpeg_destroy(Decoder *thiz)
 {
     if (thiz != NULL)
     {
+        PrivInfo *priv = (PrivInfo *)thiz->priv;
+
+        free(priv->raw);
+        free(priv->header);
         free(thiz);
     }
 }
 
 Decoder *decoder_mjpeg_create(int mjpeg_size)
 {
-    Decoder *thiz = malloc(sizeof(Decoder));
+    Decoder *thiz = malloc(sizeof(Decoder) + sizeof(PrivInfo));
     
     if (thiz != NULL)
     {
+        PrivInfo *priv = (PrivInfo *)thiz->priv;
+
+        memset(priv, 0, sizeof(PrivInfo));
         thiz->decode = decoder_mjpeg_decode;
+        thiz->split = decoder_mjpeg_split;
         thiz->destroy = decoder_mjpeg_destroy;
     }
 
@@ -0,0 +1,318 @@
+/**
+ * File: frame_writer.c
+ * Brief: Pool of threads re-encoding and saving frames behind the
+ *        capture path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "jpeg_image.h"
+#include "frame_writer.h"
+
+struct _FrameJob;
+
+/* one captured frame shared by the jobs of its outputs */
+typedef struct _FrameData
+{
+    struct _FrameJob *jobs; /* one per output */
+    unsigned char *data;
+    size_t size;
+    int refs;               /* guarded by the writer lock */
+
+    pthread_mutex_t lock;   /* the first job to run decodes the frame */
+    int parsed;             /* 0 not yet, 1 done, -1 failed */
+    JpegImage image;
+} FrameData;
+
+typedef struct _FrameJob
+{
+    char name[256];
+    FrameData *frame;
+    int has_roi;
+    FrameRoi roi;
+} FrameJob;
+
+struct _FrameWriter
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    int quit;
+
+    /* ring of pending jobs */
+    FrameJob **jobs;
+    int queue_len;
+    int head;
+    int count;
+
+    int threads;
+    pthread_t *tids;
+
+    Metrics *metrics;
+};
+
+static void save_frame(FrameWriter *thiz, const char *name,
+        const void *ptr, size_t size)
+{
+    FILE *fout = fopen(name, "w");
+
+    if (fout == NULL)
+    {
+        perror("Cannot open image");
+        return;
+    }
+
+    if (fwrite(ptr, size, 1, fout) == 1)
+    {
+        metrics_count(thiz->metrics, METRICS_BYTES, size);
+    }
+    fclose(fout);
+}
+
+static void frame_release(FrameWriter *thiz, FrameData *frame)
+{
+    int refs;
+
+    pthread_mutex_lock(&thiz->lock);
+    refs = --frame->refs;
+    pthread_mutex_unlock(&thiz->lock);
+
+    if (refs == 0)
+    {
+        if (frame->parsed > 0)
+        {
+            jpeg_image_release(&frame->image);
+        }
+        pthread_mutex_destroy(&frame->lock);
+        free(frame->jobs);
+        free(frame->data);
+        free(frame);
+    }
+}
+
+static void process_job(FrameWriter *thiz, FrameJob *job)
+{
+    FrameData *frame = job->frame;
+    unsigned char *out_buf = NULL;
+    int out_size = 0;
+
+    pthread_mutex_lock(&frame->lock);
+    if (frame->parsed == 0)
+    {
+        frame->parsed = jpeg_image_parse(&frame->image,
+                frame->data, frame->size) == 0 ? 1 : -1;
+    }
+    pthread_mutex_unlock(&frame->lock);
+
+    if (frame->parsed > 0)
+    {
+        if (job->has_roi)
+        {
+            out_size = jpeg_image_crop(&frame->image, job->roi.x, job->roi.y,
+                    job->roi.w, job->roi.h, &out_buf);
+        }
+        else
+        {
+            out_size = jpeg_image_optimize(&frame->image, &out_buf);
+        }
+    }
+
+    if (job->has_roi)
+    {
+        if (out_size > 0)
+        {
+            save_frame(thiz, job->name, out_buf, out_size);
+        }
+        else
+        {
+            fprintf(stderr, "Cannot crop %s\n", job->name);
+        }
+    }
+    /* keep the original if it could not be decoded or did not shrink */
+    else if (out_size > 0 && (size_t)out_size < frame->size)
+    {
+        save_frame(thiz, job->name, out_buf, out_size);
+    }
+    else
+    {
+        save_frame(thiz, job->name, frame->data, frame->size);
+    }
+
+    free(out_buf);
+}
+
+static void *frame_writer_thread(void *arg)
+{
+    FrameWriter *thiz = arg;
+    FrameJob *job;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&thiz->lock);
+        while (thiz->count == 0 && !thiz->quit)
+        {
+            pthread_cond_wait(&thiz->not_empty, &thiz->lock);
+        }
+
+        if (thiz->count == 0)
+        {
+            pthread_mutex_unlock(&thiz->lock);
+            break;
+        }
+
+        job = thiz->jobs[thiz->head];
+        thiz->head = (thiz->head + 1) % thiz->queue_len;
+        thiz->count--;
+        metrics_gauge_set(thiz->metrics, METRICS_WRITER_QUEUE, thiz->count);
+        pthread_mutex_unlock(&thiz->lock);
+
+        process_job(thiz, job);
+        frame_release(thiz, job->frame);
+    }
+
+    return NULL;
+}
+
+FrameWriter *frame_writer_create(int threads, int queue_len,
+        Metrics *metrics)
+{
+    int i;
+    FrameWriter *thiz = calloc(1, sizeof(FrameWriter));
+
+    if (thiz == NULL)
+    {
+        return NULL;
+    }
+
+    thiz->queue_len = queue_len;
+    thiz->metrics = metrics;
+    thiz->jobs = calloc(queue_len, sizeof(FrameJob *));
+    thiz->tids = calloc(threads, sizeof(pthread_t));
+    if (thiz->jobs == NULL || thiz->tids == NULL)
+    {
+        free(thiz->jobs);
+        free(thiz->tids);
+        free(thiz);
+        return NULL;
+    }
+
+    pthread_mutex_init(&thiz->lock, NULL);
+    pthread_cond_init(&thiz->not_empty, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&thiz->tids[i], NULL,
+                    frame_writer_thread, thiz) != 0)
+        {
+            break;
+        }
+    }
+    thiz->threads = i;
+
+    if (thiz->threads == 0)
+    {
+        frame_writer_destroy(thiz);
+        return NULL;
+    }
+
+    return thiz;
+}
+
+int frame_writer_submit(FrameWriter *thiz,
+        const FrameOutput *outputs, int n,
+        const void *header, size_t header_size,
+        const void *payload, size_t size)
+{
+    FrameData *frame;
+    int full;
+    int i;
+
+    pthread_mutex_lock(&thiz->lock);
+    full = thiz->count + n > thiz->queue_len;
+    pthread_mutex_unlock(&thiz->lock);
+
+    if (full || n == 0)
+    {
+        return -1;
+    }
+
+    frame = calloc(1, sizeof(FrameData));
+    if (frame == NULL)
+    {
+        return -1;
+    }
+
+    frame->data = malloc(header_size + size);
+    frame->jobs = calloc(n, sizeof(FrameJob));
+    if (frame->data == NULL || frame->jobs == NULL)
+    {
+        free(frame->data);
+        free(frame->jobs);
+        free(frame);
+        return -1;
+    }
+
+    if (header_size)
+    {
+        memcpy(frame->data, header, header_size);
+    }
+    memcpy(frame->data + header_size, payload, size);
+    frame->size = header_size + size;
+    frame->refs = n;
+    pthread_mutex_init(&frame->lock, NULL);
+
+    for (i = 0; i < n; i++)
+    {
+        FrameJob *job = &frame->jobs[i];
+
+        snprintf(job->name, sizeof(job->name), "%s", outputs[i].name);
+        job->frame = frame;
+        job->has_roi = outputs[i].roi != NULL;
+        if (job->has_roi)
+        {
+            job->roi = *outputs[i].roi;
+        }
+    }
+
+    /* only the capture thread submits, so the slots are still free */
+    pthread_mutex_lock(&thiz->lock);
+    for (i = 0; i < n; i++)
+    {
+        thiz->jobs[(thiz->head + thiz->count) % thiz->queue_len] =
+            &frame->jobs[i];
+        thiz->count++;
+    }
+    metrics_gauge_set(thiz->metrics, METRICS_WRITER_QUEUE, thiz->count);
+    pthread_cond_broadcast(&thiz->not_empty);
+    pthread_mutex_unlock(&thiz->lock);
+
+    return 0;
+}
+
+void frame_writer_destroy(FrameWriter *thiz)
+{
+    int i;
+
+    if (thiz == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&thiz->lock);
+    thiz->quit = 1;
+    pthread_cond_broadcast(&thiz->not_empty);
+    pthread_mutex_unlock(&thiz->lock);
+
+    for (i = 0; i < thiz->threads; i++)
+    {
+        pthread_join(thiz->tids[i], NULL);
+    }
+
+    pthread_cond_destroy(&thiz->not_empty);
+    pthread_mutex_destroy(&thiz->lock);
+    free(thiz->jobs);
+    free(thiz->tids);
+    free(thiz);
+}
@@ -0,0 +1,57 @@
+/**
+ * File: frame_writer.h
+ * Brief: Pool of threads re-encoding and saving frames behind the
+ *        capture path.
+ */
+
+#ifndef _FRAME_WRITER_H_
+#define _FRAME_WRITER_H_
+
+#include <stddef.h>
+
+#include "metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _FrameWriter;
+typedef struct _FrameWriter FrameWriter;
+
+typedef struct _FrameRoi
+{
+    int x;
+    int y;
+    int w;
+    int h;
+} FrameRoi;
+
+typedef struct _FrameOutput
+{
+    char name[256];
+    const FrameRoi *roi;    /* NULL for the whole frame */
+} FrameOutput;
+
+FrameWriter *frame_writer_create(int threads, int queue_len,
+        Metrics *metrics);
+
+/*
+ * Queue one copy of header + payload and a job per output: the whole
+ * frame with optimized huffman tables, or a region cut losslessly at
+ * MCU boundaries. The frame is entropy-decoded once for all of them.
+ * Returns -1 without copying anything if the queue can't take every
+ * output, the caller should then write the frame itself.
+ */
+int frame_writer_submit(FrameWriter *thiz,
+        const FrameOutput *outputs, int n,
+        const void *header, size_t header_size,
+        const void *payload, size_t size);
+
+/* Wait for the queued frames to be written and stop the threads. */
+void frame_writer_destroy(FrameWriter *thiz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
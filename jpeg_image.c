@@ -0,0 +1,1125 @@
+/**
+ * File: jpeg_image.c
+ * Brief: Baseline JPEG held as quantized DCT coefficients, so frames can
+ *        be re-entropy-coded losslessly.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "jpeg_image.h"
+
+#define HUFF_LOOKAHEAD 9
+
+typedef struct _HuffTable
+{
+    int present;
+    unsigned char bits[17];     /* bits[l]: number of codes of length l */
+    unsigned char vals[256];
+
+    int maxcode[18];
+    int valptr[17];
+    int mincode[17];
+    unsigned short look[1 << HUFF_LOOKAHEAD]; /* (length << 8) | value */
+} HuffTable;
+
+typedef struct _HuffCode
+{
+    unsigned short code[256];
+    unsigned char size[256];
+} HuffCode;
+
+typedef struct _Region
+{
+    int mx0;                    /* MCUs [mx0, mx1) x [my0, my1) */
+    int my0;
+    int mx1;
+    int my1;
+    int width;                  /* size in pixels */
+    int height;
+} Region;
+
+typedef struct _BitReader
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    unsigned int acc;
+    int bits;
+    int fake;                   /* zero bytes fed past a marker */
+} BitReader;
+
+typedef struct _BitWriter
+{
+    unsigned char *buf;
+    int size;
+    int cap;
+    unsigned int acc;
+    int bits;
+    int failed;
+} BitWriter;
+
+static const unsigned char *segment_next(const unsigned char *p,
+        const unsigned char *end, int *marker, int *len)
+{
+    /* markers may be preceded by any number of fill bytes */
+    while (p + 1 < end && p[0] == 0xff && p[1] == 0xff)
+    {
+        p++;
+    }
+
+    if (p + 4 > end || p[0] != 0xff)
+    {
+        return NULL;
+    }
+
+    *marker = p[1];
+    *len = (p[2] << 8) | p[3];
+
+    if (*len < 2 || p + 2 + *len > end)
+    {
+        return NULL;
+    }
+
+    return p;
+}
+
+static int huff_table_build(HuffTable *t)
+{
+    int l, i, j;
+    int p = 0;
+    int code = 0;
+
+    memset(t->look, 0, sizeof(t->look));
+
+    for (l = 1; l <= 16; l++)
+    {
+        t->valptr[l] = p;
+        t->mincode[l] = code;
+
+        for (i = 0; i < t->bits[l]; i++, p++, code++)
+        {
+            if (p >= 256 || code >= (1 << l))
+            {
+                return -1;
+            }
+
+            if (l <= HUFF_LOOKAHEAD)
+            {
+                int shift = HUFF_LOOKAHEAD - l;
+
+                for (j = 0; j < (1 << shift); j++)
+                {
+                    t->look[(code << shift) | j] = (l << 8) | t->vals[p];
+                }
+            }
+        }
+
+        t->maxcode[l] = t->bits[l] ? code - 1 : -1;
+        code <<= 1;
+    }
+    t->maxcode[17] = INT_MAX;
+    t->present = 1;
+
+    return 0;
+}
+
+static int parse_dht(HuffTable dc[4], HuffTable ac[4],
+        const unsigned char *p, int len)
+{
+    while (len > 0)
+    {
+        HuffTable *t;
+        int i;
+        int count = 0;
+
+        if (len < 17 || (p[0] >> 4) > 1 || (p[0] & 0x0f) > 3)
+        {
+            return -1;
+        }
+
+        t = (p[0] >> 4) ? &ac[p[0] & 0x0f] : &dc[p[0] & 0x0f];
+        t->bits[0] = 0;
+        for (i = 1; i <= 16; i++)
+        {
+            t->bits[i] = p[i];
+            count += p[i];
+        }
+
+        if (count > 256 || 17 + count > len)
+        {
+            return -1;
+        }
+
+        memcpy(t->vals, p + 17, count);
+        if (huff_table_build(t) != 0)
+        {
+            return -1;
+        }
+
+        p += 17 + count;
+        len -= 17 + count;
+    }
+
+    return 0;
+}
+
+static void br_fill(BitReader *br)
+{
+    while (br->bits <= 24)
+    {
+        unsigned int c = 0;
+
+        if (br->p < br->end && br->p[0] != 0xff)
+        {
+            c = *br->p++;
+        }
+        else if (br->p + 1 < br->end && br->p[1] == 0x00)
+        {
+            /* stuffed zero after 0xff */
+            c = 0xff;
+            br->p += 2;
+        }
+        else
+        {
+            /* a marker or the end of data: feed zeros, never consume it */
+            br->fake++;
+        }
+
+        br->acc = (br->acc << 8) | c;
+        br->bits += 8;
+    }
+}
+
+static int br_get(BitReader *br, int n)
+{
+    int v;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    br_fill(br);
+    br->bits -= n;
+    v = (br->acc >> br->bits) & ((1u << n) - 1);
+
+    return v;
+}
+
+static int br_overrun(BitReader *br)
+{
+    return br->fake * 8 > br->bits;
+}
+
+static int br_restart(BitReader *br)
+{
+    br->acc = 0;
+    br->bits = 0;
+    br->fake = 0;
+
+    /* the padding bits before RSTn were already buffered */
+    while (br->p + 1 < br->end)
+    {
+        if (br->p[0] == 0xff && br->p[1] >= 0xd0 && br->p[1] <= 0xd7)
+        {
+            br->p += 2;
+            return 0;
+        }
+        br->p++;
+    }
+
+    return -1;
+}
+
+static int huff_decode(BitReader *br, const HuffTable *t)
+{
+    int look;
+    int l;
+    int code;
+
+    br_fill(br);
+    look = (br->acc >> (br->bits - HUFF_LOOKAHEAD)) & ((1 << HUFF_LOOKAHEAD) - 1);
+    if (t->look[look] != 0)
+    {
+        br->bits -= t->look[look] >> 8;
+        return t->look[look] & 0xff;
+    }
+
+    code = 0;
+    for (l = 1; l <= 16; l++)
+    {
+        code = (code << 1) | br_get(br, 1);
+        if (code <= t->maxcode[l])
+        {
+            return t->vals[t->valptr[l] + code - t->mincode[l]];
+        }
+    }
+
+    return -1;
+}
+
+static int extend(int v, int s)
+{
+    return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+static int decode_block(BitReader *br, const HuffTable *dc,
+        const HuffTable *ac, int *pred, short *block)
+{
+    int k;
+    int s;
+
+    s = huff_decode(br, dc);
+    if (s < 0 || s > 11)
+    {
+        return -1;
+    }
+    *pred += s ? extend(br_get(br, s), s) : 0;
+    block[0] = *pred;
+
+    for (k = 1; k < 64; k++)
+    {
+        int rs = huff_decode(br, ac);
+        int r = rs >> 4;
+
+        if (rs < 0)
+        {
+            return -1;
+        }
+
+        s = rs & 0x0f;
+        if (s == 0)
+        {
+            if (r != 15)
+            {
+                break;
+            }
+            k += 15;
+            continue;
+        }
+
+        k += r;
+        if (k > 63 || s > 10)
+        {
+            return -1;
+        }
+        block[k] = extend(br_get(br, s), s);
+    }
+
+    return 0;
+}
+
+static short *component_block(JpegComponent *c, int bx, int by)
+{
+    return c->coef + ((by * c->blocks_w) + bx) * 64;
+}
+
+static int parse_sof(JpegImage *thiz, const unsigned char *p, int len)
+{
+    int i;
+    int hmax = 1;
+    int vmax = 1;
+
+    if (len < 6 || p[0] != 8)
+    {
+        return -1;
+    }
+
+    thiz->height = (p[1] << 8) | p[2];
+    thiz->width = (p[3] << 8) | p[4];
+    thiz->ncomps = p[5];
+
+    if (thiz->width == 0 || thiz->height == 0
+        || thiz->ncomps < 1 || thiz->ncomps > JPEG_MAX_COMPONENTS
+        || len < 6 + 3 * thiz->ncomps)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < thiz->ncomps; i++)
+    {
+        JpegComponent *c = &thiz->comp[i];
+
+        c->id = p[6 + 3 * i];
+        c->hv = p[7 + 3 * i];
+        c->h = c->hv >> 4;
+        c->v = c->hv & 0x0f;
+        c->tq = p[8 + 3 * i];
+
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4)
+        {
+            return -1;
+        }
+
+        /* a single component scan is not interleaved */
+        if (thiz->ncomps == 1)
+        {
+            c->h = c->v = 1;
+        }
+
+        hmax = c->h > hmax ? c->h : hmax;
+        vmax = c->v > vmax ? c->v : vmax;
+    }
+
+    thiz->mcu_w = hmax * 8;
+    thiz->mcu_h = vmax * 8;
+    thiz->mcus_x = (thiz->width + thiz->mcu_w - 1) / thiz->mcu_w;
+    thiz->mcus_y = (thiz->height + thiz->mcu_h - 1) / thiz->mcu_h;
+
+    for (i = 0; i < thiz->ncomps; i++)
+    {
+        JpegComponent *c = &thiz->comp[i];
+
+        c->blocks_w = thiz->mcus_x * c->h;
+        c->blocks_h = thiz->mcus_y * c->v;
+        c->coef = calloc((size_t)c->blocks_w * c->blocks_h * 64,
+                sizeof(short));
+        if (c->coef == NULL)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int parse_sos(JpegImage *thiz, HuffTable dc[4], HuffTable ac[4],
+        const unsigned char *p, int len)
+{
+    int i, j;
+
+    /* only a single scan holding every component is supported */
+    if (len < 1 || p[0] != thiz->ncomps || len < 4 + 2 * p[0])
+    {
+        return -1;
+    }
+
+    for (i = 0; i < thiz->ncomps; i++)
+    {
+        JpegComponent *c = &thiz->comp[i];
+
+        if (p[1 + 2 * i] != c->id)
+        {
+            return -1;
+        }
+
+        c->td = p[2 + 2 * i] >> 4;
+        c->ta = p[2 + 2 * i] & 0x0f;
+        if (c->td > 3 || c->ta > 3 || !dc[c->td].present
+            || !ac[c->ta].present)
+        {
+            return -1;
+        }
+    }
+
+    j = 1 + 2 * thiz->ncomps;
+    if (p[j] != 0 || p[j + 1] != 63 || p[j + 2] != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int decode_scan(JpegImage *thiz, HuffTable dc[4], HuffTable ac[4],
+        int restart_interval, const unsigned char *p,
+        const unsigned char *end)
+{
+    int mx, my, i, bx, by;
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+    int todo = restart_interval;
+    BitReader br;
+
+    memset(&br, 0, sizeof(br));
+    br.p = p;
+    br.end = end;
+
+    for (my = 0; my < thiz->mcus_y; my++)
+    {
+        for (mx = 0; mx < thiz->mcus_x; mx++)
+        {
+            if (restart_interval)
+            {
+                if (todo == 0)
+                {
+                    if (br_restart(&br) != 0)
+                    {
+                        return -1;
+                    }
+                    memset(pred, 0, sizeof(pred));
+                    todo = restart_interval;
+                }
+                todo--;
+            }
+
+            for (i = 0; i < thiz->ncomps; i++)
+            {
+                JpegComponent *c = &thiz->comp[i];
+
+                for (by = 0; by < c->v; by++)
+                {
+                    for (bx = 0; bx < c->h; bx++)
+                    {
+                        short *block = component_block(c,
+                                mx * c->h + bx, my * c->v + by);
+
+                        if (decode_block(&br, &dc[c->td], &ac[c->ta],
+                                    &pred[i], block) != 0)
+                        {
+                            return -1;
+                        }
+                    }
+                }
+            }
+
+            if (br_overrun(&br))
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int jpeg_image_parse(JpegImage *thiz, const unsigned char *buf, int size)
+{
+    const unsigned char *p = buf + 2;
+    const unsigned char *end = buf + size;
+    int restart_interval = 0;
+    int marker, len;
+    HuffTable *dc, *ac;
+    int ret = -1;
+
+    memset(thiz, 0, sizeof(*thiz));
+
+    if (size < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+    {
+        return -1;
+    }
+
+    dc = calloc(8, sizeof(HuffTable));
+    if (dc == NULL)
+    {
+        return -1;
+    }
+    ac = dc + 4;
+
+    while ((p = segment_next(p, end, &marker, &len)) != NULL)
+    {
+        const unsigned char *seg = p + 4;
+
+        if (marker == 0xc0 || marker == 0xc1)
+        {
+            if (thiz->sof || parse_sof(thiz, seg, len - 2) != 0)
+            {
+                break;
+            }
+            thiz->sof = marker;
+        }
+        else if (marker == 0xc4)
+        {
+            if (parse_dht(dc, ac, seg, len - 2) != 0)
+            {
+                break;
+            }
+        }
+        else if (marker == 0xdd)
+        {
+            if (len != 4)
+            {
+                break;
+            }
+            restart_interval = (seg[0] << 8) | seg[1];
+        }
+        else if (marker == 0xda)
+        {
+            if (thiz->sof && parse_sos(thiz, dc, ac, seg, len - 2) == 0)
+            {
+                ret = decode_scan(thiz, dc, ac, restart_interval,
+                        p + 2 + len, end);
+            }
+            break;
+        }
+        else if ((marker >= 0xc2 && marker <= 0xcf) || marker == 0xd8
+                 || marker == 0xd9 || marker == 0xdc)
+        {
+            /* progressive, arithmetic, lossless or DNL */
+            break;
+        }
+        else
+        {
+            if (thiz->nsegs == JPEG_MAX_SEGMENTS)
+            {
+                break;
+            }
+            thiz->segs[thiz->nsegs].data = p;
+            thiz->segs[thiz->nsegs].size = 2 + len;
+            thiz->nsegs++;
+        }
+
+        p += 2 + len;
+    }
+
+    free(dc);
+    if (ret != 0)
+    {
+        jpeg_image_release(thiz);
+    }
+
+    return ret;
+}
+
+void jpeg_image_release(JpegImage *thiz)
+{
+    int i;
+
+    for (i = 0; i < JPEG_MAX_COMPONENTS; i++)
+    {
+        free(thiz->comp[i].coef);
+        thiz->comp[i].coef = NULL;
+    }
+}
+
+static int category(int v)
+{
+    int n = 0;
+
+    if (v < 0)
+    {
+        v = -v;
+    }
+
+    while (v)
+    {
+        n++;
+        v >>= 1;
+    }
+
+    return n;
+}
+
+static void count_block(const short *block, int *pred, long *dc, long *ac)
+{
+    int k;
+    int r = 0;
+
+    dc[category(block[0] - *pred)]++;
+    *pred = block[0];
+
+    for (k = 1; k < 64; k++)
+    {
+        if (block[k] == 0)
+        {
+            r++;
+            continue;
+        }
+
+        while (r > 15)
+        {
+            ac[0xf0]++;
+            r -= 16;
+        }
+        ac[(r << 4) | category(block[k])]++;
+        r = 0;
+    }
+
+    if (r > 0)
+    {
+        ac[0x00]++;
+    }
+}
+
+/* Same algorithm as jpeg_gen_optimal_table() of the IJG library. */
+static int huff_optimal(const long *freq_in, unsigned char bits[17],
+        unsigned char vals[256])
+{
+    long freq[257];
+    int codesize[257];
+    int others[257];
+    int bitcount[33];
+    int c1, c2, i, j, p;
+    long v;
+
+    memcpy(freq, freq_in, 256 * sizeof(long));
+    /* reserve one code point so no real code is all ones */
+    freq[256] = 1;
+
+    memset(codesize, 0, sizeof(codesize));
+    for (i = 0; i < 257; i++)
+    {
+        others[i] = -1;
+    }
+
+    for (;;)
+    {
+        c1 = -1;
+        v = LONG_MAX;
+        for (i = 0; i <= 256; i++)
+        {
+            if (freq[i] && freq[i] <= v)
+            {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+
+        c2 = -1;
+        v = LONG_MAX;
+        for (i = 0; i <= 256; i++)
+        {
+            if (freq[i] && freq[i] <= v && i != c1)
+            {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+
+        if (c2 < 0)
+        {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0)
+        {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+
+        codesize[c2]++;
+        while (others[c2] >= 0)
+        {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    memset(bitcount, 0, sizeof(bitcount));
+    for (i = 0; i <= 256; i++)
+    {
+        if (codesize[i])
+        {
+            if (codesize[i] > 32)
+            {
+                return -1;
+            }
+            bitcount[codesize[i]]++;
+        }
+    }
+
+    /* limit code lengths to 16 bits */
+    for (i = 32; i > 16; i--)
+    {
+        while (bitcount[i] > 0)
+        {
+            j = i - 2;
+            while (bitcount[j] == 0)
+            {
+                j--;
+            }
+
+            bitcount[i] -= 2;
+            bitcount[i - 1]++;
+            bitcount[j + 1] += 2;
+            bitcount[j]--;
+        }
+    }
+
+    /* drop the reserved code point, it is always the longest */
+    while (i > 0 && bitcount[i] == 0)
+    {
+        i--;
+    }
+    if (i == 0)
+    {
+        return -1;
+    }
+    bitcount[i]--;
+
+    bits[0] = 0;
+    for (i = 1; i <= 16; i++)
+    {
+        bits[i] = bitcount[i];
+    }
+
+    p = 0;
+    for (i = 1; i <= 32; i++)
+    {
+        for (j = 0; j < 256; j++)
+        {
+            if (codesize[j] == i)
+            {
+                vals[p++] = j;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void huff_code_build(HuffCode *hc, const unsigned char bits[17],
+        const unsigned char vals[256])
+{
+    int l, i;
+    int p = 0;
+    int code = 0;
+
+    memset(hc, 0, sizeof(*hc));
+    for (l = 1; l <= 16; l++)
+    {
+        for (i = 0; i < bits[l]; i++, p++, code++)
+        {
+            hc->code[vals[p]] = code;
+            hc->size[vals[p]] = l;
+        }
+        code <<= 1;
+    }
+}
+
+static void bw_byte(BitWriter *bw, int c)
+{
+    if (bw->size == bw->cap)
+    {
+        unsigned char *buf = realloc(bw->buf, bw->cap * 2);
+
+        if (buf == NULL)
+        {
+            bw->failed = 1;
+            return;
+        }
+        bw->buf = buf;
+        bw->cap *= 2;
+    }
+
+    bw->buf[bw->size++] = c;
+}
+
+static void bw_word(BitWriter *bw, int w)
+{
+    bw_byte(bw, w >> 8);
+    bw_byte(bw, w & 0xff);
+}
+
+static void bw_put(BitWriter *bw, unsigned int code, int n)
+{
+    bw->acc = (bw->acc << n) | (code & ((1u << n) - 1));
+    bw->bits += n;
+
+    while (bw->bits >= 8)
+    {
+        int c = (bw->acc >> (bw->bits - 8)) & 0xff;
+
+        bw_byte(bw, c);
+        if (c == 0xff)
+        {
+            bw_byte(bw, 0x00);
+        }
+        bw->bits -= 8;
+    }
+}
+
+static void bw_flush(BitWriter *bw)
+{
+    /* pad the last byte with ones */
+    if (bw->bits > 0)
+    {
+        bw_put(bw, 0x7f, 7);
+    }
+    bw->acc = 0;
+    bw->bits = 0;
+}
+
+static void encode_value(BitWriter *bw, const HuffCode *hc, int sym, int v,
+        int s)
+{
+    bw_put(bw, hc->code[sym], hc->size[sym]);
+    if (s)
+    {
+        bw_put(bw, v < 0 ? v - 1 : v, s);
+    }
+}
+
+static void encode_block(BitWriter *bw, const short *block, int *pred,
+        const HuffCode *dc, const HuffCode *ac)
+{
+    int k, s;
+    int r = 0;
+    int diff = block[0] - *pred;
+
+    *pred = block[0];
+    s = category(diff);
+    encode_value(bw, dc, s, diff, s);
+
+    for (k = 1; k < 64; k++)
+    {
+        if (block[k] == 0)
+        {
+            r++;
+            continue;
+        }
+
+        while (r > 15)
+        {
+            bw_put(bw, ac->code[0xf0], ac->size[0xf0]);
+            r -= 16;
+        }
+        s = category(block[k]);
+        encode_value(bw, ac, (r << 4) | s, block[k], s);
+        r = 0;
+    }
+
+    if (r > 0)
+    {
+        bw_put(bw, ac->code[0x00], ac->size[0x00]);
+    }
+}
+
+static void write_dht(BitWriter *bw, unsigned char bits[8][17],
+        unsigned char vals[8][256], const int *used)
+{
+    int t, i;
+    int len = 2;
+
+    for (t = 0; t < 8; t++)
+    {
+        if (used[t])
+        {
+            int count = 0;
+
+            for (i = 1; i <= 16; i++)
+            {
+                count += bits[t][i];
+            }
+            len += 17 + count;
+        }
+    }
+
+    bw_word(bw, 0xffc4);
+    bw_word(bw, len);
+    for (t = 0; t < 8; t++)
+    {
+        int count = 0;
+
+        if (!used[t])
+        {
+            continue;
+        }
+
+        /* tables 0-3 are DC, 4-7 are AC */
+        bw_byte(bw, ((t >> 2) << 4) | (t & 3));
+        for (i = 1; i <= 16; i++)
+        {
+            bw_byte(bw, bits[t][i]);
+            count += bits[t][i];
+        }
+        for (i = 0; i < count; i++)
+        {
+            bw_byte(bw, vals[t][i]);
+        }
+    }
+}
+
+static void write_headers(JpegImage *thiz, BitWriter *bw,
+        const Region *r)
+{
+    int i, j;
+
+    bw_word(bw, 0xffd8);
+    for (i = 0; i < thiz->nsegs; i++)
+    {
+        for (j = 0; j < thiz->segs[i].size; j++)
+        {
+            bw_byte(bw, thiz->segs[i].data[j]);
+        }
+    }
+
+    bw_word(bw, 0xff00 | thiz->sof);
+    bw_word(bw, 8 + 3 * thiz->ncomps);
+    bw_byte(bw, 8);
+    bw_word(bw, r->height);
+    bw_word(bw, r->width);
+    bw_byte(bw, thiz->ncomps);
+    for (i = 0; i < thiz->ncomps; i++)
+    {
+        bw_byte(bw, thiz->comp[i].id);
+        bw_byte(bw, thiz->comp[i].hv);
+        bw_byte(bw, thiz->comp[i].tq);
+    }
+}
+
+static void write_sos(JpegImage *thiz, BitWriter *bw)
+{
+    int i;
+
+    bw_word(bw, 0xffda);
+    bw_word(bw, 6 + 2 * thiz->ncomps);
+    bw_byte(bw, thiz->ncomps);
+    for (i = 0; i < thiz->ncomps; i++)
+    {
+        bw_byte(bw, thiz->comp[i].id);
+        bw_byte(bw, (thiz->comp[i].td << 4) | thiz->comp[i].ta);
+    }
+    bw_byte(bw, 0);
+    bw_byte(bw, 63);
+    bw_byte(bw, 0);
+}
+
+static int encode_region(JpegImage *thiz, const Region *r,
+        unsigned char **out_buf)
+{
+    int mx, my, i, bx, by, t;
+    int pred[JPEG_MAX_COMPONENTS];
+    int used[8] = { 0 };
+    long (*freq)[256];
+    unsigned char bits[8][17];
+    unsigned char vals[8][256];
+    HuffCode *hc;
+    BitWriter bw;
+    int ret = -1;
+
+    freq = calloc(8, sizeof(*freq));
+    hc = malloc(8 * sizeof(HuffCode));
+    if (freq == NULL || hc == NULL)
+    {
+        goto out;
+    }
+
+    /* first pass: gather symbol statistics */
+    memset(pred, 0, sizeof(pred));
+    for (my = r->my0; my < r->my1; my++)
+    {
+        for (mx = r->mx0; mx < r->mx1; mx++)
+        {
+            for (i = 0; i < thiz->ncomps; i++)
+            {
+                JpegComponent *c = &thiz->comp[i];
+
+                for (by = 0; by < c->v; by++)
+                {
+                    for (bx = 0; bx < c->h; bx++)
+                    {
+                        count_block(component_block(c,
+                                    mx * c->h + bx, my * c->v + by),
+                                &pred[i], freq[c->td], freq[4 + c->ta]);
+                    }
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < thiz->ncomps; i++)
+    {
+        used[thiz->comp[i].td] = 1;
+        used[4 + thiz->comp[i].ta] = 1;
+    }
+
+    for (t = 0; t < 8; t++)
+    {
+        if (!used[t])
+        {
+            continue;
+        }
+
+        if (huff_optimal(freq[t], bits[t], vals[t]) != 0)
+        {
+            goto out;
+        }
+        huff_code_build(&hc[t], bits[t], vals[t]);
+    }
+
+    /* second pass: emit the frame */
+    memset(&bw, 0, sizeof(bw));
+    bw.cap = 64 * 1024;
+    bw.buf = malloc(bw.cap);
+    if (bw.buf == NULL)
+    {
+        goto out;
+    }
+
+    write_headers(thiz, &bw, r);
+    write_dht(&bw, bits, vals, used);
+    write_sos(thiz, &bw);
+
+    memset(pred, 0, sizeof(pred));
+    for (my = r->my0; my < r->my1; my++)
+    {
+        for (mx = r->mx0; mx < r->mx1; mx++)
+        {
+            for (i = 0; i < thiz->ncomps; i++)
+            {
+                JpegComponent *c = &thiz->comp[i];
+
+                for (by = 0; by < c->v; by++)
+                {
+                    for (bx = 0; bx < c->h; bx++)
+                    {
+                        encode_block(&bw, component_block(c,
+                                    mx * c->h + bx, my * c->v + by),
+                                &pred[i], &hc[c->td], &hc[4 + c->ta]);
+                    }
+                }
+            }
+        }
+    }
+    bw_flush(&bw);
+    bw_word(&bw, 0xffd9);
+
+    if (bw.failed)
+    {
+        free(bw.buf);
+        goto out;
+    }
+
+    *out_buf = bw.buf;
+    ret = bw.size;
+
+out:
+    free(freq);
+    free(hc);
+
+    return ret < 0 ? 0 : ret;
+}
+
+int jpeg_image_optimize(JpegImage *thiz, unsigned char **out_buf)
+{
+    Region r = { 0, 0, thiz->mcus_x, thiz->mcus_y,
+                 thiz->width, thiz->height };
+
+    return encode_region(thiz, &r, out_buf);
+}
+
+int jpeg_image_crop(JpegImage *thiz, int x, int y, int w, int h,
+        unsigned char **out_buf)
+{
+    Region r;
+
+    if (x < 0 || y < 0 || w <= 0 || h <= 0
+        || x >= thiz->width || y >= thiz->height)
+    {
+        return 0;
+    }
+
+    /* grow the rectangle outwards to whole MCUs */
+    r.mx0 = x / thiz->mcu_w;
+    r.my0 = y / thiz->mcu_h;
+    r.mx1 = (x + w + thiz->mcu_w - 1) / thiz->mcu_w;
+    r.my1 = (y + h + thiz->mcu_h - 1) / thiz->mcu_h;
+    r.mx1 = r.mx1 > thiz->mcus_x ? thiz->mcus_x : r.mx1;
+    r.my1 = r.my1 > thiz->mcus_y ? thiz->mcus_y : r.my1;
+
+    /* the last MCU column or row may be partial */
+    r.width = r.mx1 * thiz->mcu_w;
+    r.width = (r.width > thiz->width ? thiz->width : r.width)
+        - r.mx0 * thiz->mcu_w;
+    r.height = r.my1 * thiz->mcu_h;
+    r.height = (r.height > thiz->height ? thiz->height : r.height)
+        - r.my0 * thiz->mcu_h;
+
+    return encode_region(thiz, &r, out_buf);
+}
@@ -0,0 +1,83 @@
+/**
+ * File: jpeg_image.h
+ * Brief: Baseline JPEG held as quantized DCT coefficients, so frames can
+ *        be re-entropy-coded losslessly.
+ */
+
+#ifndef _JPEG_IMAGE_H_
+#define _JPEG_IMAGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JPEG_MAX_COMPONENTS 4
+#define JPEG_MAX_SEGMENTS   32
+
+typedef struct _JpegComponent
+{
+    int id;
+    int h;                  /* horizontal sampling factor */
+    int v;                  /* vertical sampling factor */
+    int hv;                 /* sampling byte as found in SOF */
+    int tq;                 /* quantization table */
+    int td;                 /* DC huffman table of the scan */
+    int ta;                 /* AC huffman table of the scan */
+    int blocks_w;           /* blocks per row, padded to whole MCUs */
+    int blocks_h;
+    short *coef;            /* blocks_w * blocks_h * 64, zigzag order */
+} JpegComponent;
+
+typedef struct _JpegSegment
+{
+    const unsigned char *data; /* marker included */
+    int size;
+} JpegSegment;
+
+typedef struct _JpegImage
+{
+    int sof;                /* 0xc0 or 0xc1 */
+    int width;
+    int height;
+    int mcu_w;              /* MCU size in pixels */
+    int mcu_h;
+    int mcus_x;
+    int mcus_y;
+
+    int ncomps;
+    JpegComponent comp[JPEG_MAX_COMPONENTS];
+
+    /* APPn, DQT, COM... copied verbatim, they point into the input */
+    int nsegs;
+    JpegSegment segs[JPEG_MAX_SEGMENTS];
+} JpegImage;
+
+/*
+ * Entropy-decode a baseline JPEG. The input must outlive the image.
+ * Returns 0 on success, -1 if the frame is broken or not baseline.
+ */
+int jpeg_image_parse(JpegImage *thiz, const unsigned char *buf, int size);
+
+/*
+ * Encode the image again with per-frame optimal huffman tables. Returns
+ * the size of the new JPEG in *out_buf, which the caller must free, or
+ * 0 on failure.
+ */
+int jpeg_image_optimize(JpegImage *thiz, unsigned char **out_buf);
+
+/*
+ * Cut the rectangle at (x, y) of size w x h, grown to MCU boundaries,
+ * into a JPEG of its own without requantizing. Same return as
+ * jpeg_image_optimize(). The image is only read, so several crops may
+ * run on one image concurrently.
+ */
+int jpeg_image_crop(JpegImage *thiz, int x, int y, int w, int h,
+        unsigned char **out_buf);
+
+void jpeg_image_release(JpegImage *thiz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,467 @@
+/**
+ * File: metrics.c
+ * Brief: Live counters published in Prometheus text format over a unix
+ *        socket. Updates are lock-free, a NULL Metrics is a no-op.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define METRICS_BUF_SIZE 16384
+
+/* latency histogram bounds in microseconds, plus +Inf */
+static const unsigned long bucket_bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000
+};
+#define BUCKET_NR (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+static const char *counter_names[METRICS_COUNTER_NR][2] = {
+    { "v4l2grab_frames_captured_total", "Frames dequeued from the driver" },
+    { "v4l2grab_frames_dropped_total", "Frames lost per sequence gaps" },
+    { "v4l2grab_bytes_written_total", "Image bytes written to disk" },
+    { "v4l2grab_writer_fallback_total",
+      "Frames not handed to the workers because they fell behind" },
+    { "v4l2grab_reconnects_total", "Capture restarts after a device loss" },
+};
+
+static const char *gauge_names[METRICS_GAUGE_NR][2] = {
+    { "v4l2grab_buffers", "Capture buffers allocated" },
+    { "v4l2grab_buffers_held", "Capture buffers dequeued by the grabber" },
+    { "v4l2grab_writer_queue_depth",
+      "Outputs (whole frames and regions) waiting for the writer threads" },
+    { "v4l2grab_last_reconnect_milliseconds",
+      "Time the last capture restart took" },
+};
+
+static const char *stage_names[METRICS_STAGE_NR] = {
+    "dequeue", "decode", "output"
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+typedef struct _Histogram
+{
+    atomic_ulong buckets[BUCKET_NR];
+    atomic_ulong sum;
+    atomic_ulong count;
+} Histogram;
+
+typedef struct _OutBuf
+{
+    char data[METRICS_BUF_SIZE];
+    int size;
+} OutBuf;
+
+struct _Metrics
+{
+    atomic_ulong counters[METRICS_COUNTER_NR];
+    atomic_long gauges[METRICS_GAUGE_NR];
+    Histogram stages[METRICS_STAGE_NR];
+
+    atomic_uint pixelformat;
+    atomic_int width;
+    atomic_int height;
+    atomic_uint fps_num;
+    atomic_uint fps_den;
+
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int fd;
+    atomic_int quit;
+    pthread_t tid;
+};
+
+unsigned long metrics_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void metrics_count(Metrics *thiz, MetricsCounter counter, unsigned long n)
+{
+    if (thiz != NULL)
+    {
+        atomic_fetch_add_explicit(&thiz->counters[counter], n,
+                memory_order_relaxed);
+    }
+}
+
+void metrics_gauge_set(Metrics *thiz, MetricsGauge gauge, long value)
+{
+    if (thiz != NULL)
+    {
+        atomic_store_explicit(&thiz->gauges[gauge], value,
+                memory_order_relaxed);
+    }
+}
+
+void metrics_gauge_add(Metrics *thiz, MetricsGauge gauge, long delta)
+{
+    if (thiz != NULL)
+    {
+        atomic_fetch_add_explicit(&thiz->gauges[gauge], delta,
+                memory_order_relaxed);
+    }
+}
+
+void metrics_latency(Metrics *thiz, MetricsStage stage, unsigned long usec)
+{
+    Histogram *h;
+    size_t i = 0;
+
+    if (thiz == NULL)
+    {
+        return;
+    }
+
+    while (i < BUCKET_NR - 1 && usec > bucket_bounds[i])
+    {
+        i++;
+    }
+
+    h = &thiz->stages[stage];
+    atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, usec, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+void metrics_format(Metrics *thiz, unsigned int pixelformat,
+        int width, int height, unsigned int fps_num, unsigned int fps_den)
+{
+    if (thiz != NULL)
+    {
+        atomic_store(&thiz->pixelformat, pixelformat);
+        atomic_store(&thiz->width, width);
+        atomic_store(&thiz->height, height);
+        atomic_store(&thiz->fps_num, fps_num);
+        atomic_store(&thiz->fps_den, fps_den);
+    }
+}
+
+static void out_printf(OutBuf *out, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (out->size >= METRICS_BUF_SIZE)
+    {
+        return;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->data + out->size, METRICS_BUF_SIZE - out->size,
+            fmt, ap);
+    va_end(ap);
+
+    out->size += n > 0 ? n : 0;
+}
+
+/*
+ * Estimate a quantile by interpolating inside the histogram bucket. NaN
+ * when nothing was recorded, e.g. for a stage the driver can't time.
+ */
+static double histogram_quantile(const unsigned long *buckets,
+        unsigned long count, double q)
+{
+    double rank = q * count;
+    double lower = 0;
+    unsigned long seen = 0;
+    size_t i;
+
+    if (count == 0)
+    {
+        return NAN;
+    }
+
+    for (i = 0; i < BUCKET_NR - 1; i++)
+    {
+        if (buckets[i] && seen + buckets[i] >= rank)
+        {
+            return lower + (bucket_bounds[i] - lower)
+                * (rank - seen) / buckets[i];
+        }
+        seen += buckets[i];
+        lower = bucket_bounds[i];
+    }
+
+    return lower;
+}
+
+static void render_histogram(OutBuf *out, Histogram *h, const char *stage)
+{
+    unsigned long buckets[BUCKET_NR];
+    unsigned long cumulative = 0;
+    unsigned long count = 0;
+    size_t i;
+
+    for (i = 0; i < BUCKET_NR; i++)
+    {
+        buckets[i] = atomic_load_explicit(&h->buckets[i],
+                memory_order_relaxed);
+        count += buckets[i];
+    }
+
+    for (i = 0; i < BUCKET_NR; i++)
+    {
+        cumulative += buckets[i];
+        if (i < BUCKET_NR - 1)
+        {
+            out_printf(out, "v4l2grab_stage_latency_seconds_bucket"
+                    "{stage=\"%s\",le=\"%g\"} %lu\n",
+                    stage, bucket_bounds[i] / 1e6, cumulative);
+        }
+        else
+        {
+            out_printf(out, "v4l2grab_stage_latency_seconds_bucket"
+                    "{stage=\"%s\",le=\"+Inf\"} %lu\n", stage, cumulative);
+        }
+    }
+
+    out_printf(out, "v4l2grab_stage_latency_seconds_sum{stage=\"%s\"} %g\n",
+            stage, atomic_load(&h->sum) / 1e6);
+    out_printf(out, "v4l2grab_stage_latency_seconds_count{stage=\"%s\"} %lu\n",
+            stage, count);
+}
+
+static void render(Metrics *thiz, OutBuf *out)
+{
+    unsigned int fourcc = atomic_load(&thiz->pixelformat);
+    unsigned int fps_num = atomic_load(&thiz->fps_num);
+    unsigned int fps_den = atomic_load(&thiz->fps_den);
+    int i;
+    size_t q;
+
+    for (i = 0; i < METRICS_COUNTER_NR; i++)
+    {
+        out_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+                counter_names[i][0], counter_names[i][1],
+                counter_names[i][0], counter_names[i][0],
+                atomic_load_explicit(&thiz->counters[i],
+                    memory_order_relaxed));
+    }
+
+    for (i = 0; i < METRICS_GAUGE_NR; i++)
+    {
+        out_printf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n",
+                gauge_names[i][0], gauge_names[i][1],
+                gauge_names[i][0], gauge_names[i][0],
+                atomic_load_explicit(&thiz->gauges[i],
+                    memory_order_relaxed));
+    }
+
+    /* nothing negotiated yet, a zero fourcc would print NUL bytes */
+    if (fourcc)
+    {
+        out_printf(out, "# HELP v4l2grab_format_info "
+                "Negotiated capture format\n"
+                "# TYPE v4l2grab_format_info gauge\n"
+                "v4l2grab_format_info{pixelformat=\"%c%c%c%c\","
+                "width=\"%d\",height=\"%d\"} 1\n",
+                fourcc & 0xff, (fourcc >> 8) & 0xff,
+                (fourcc >> 16) & 0xff, (fourcc >> 24) & 0xff,
+                atomic_load(&thiz->width), atomic_load(&thiz->height));
+    }
+
+    /* timeperframe is num/den seconds */
+    out_printf(out, "# HELP v4l2grab_fps Negotiated frame rate\n"
+            "# TYPE v4l2grab_fps gauge\nv4l2grab_fps %g\n",
+            fps_num ? (double)fps_den / fps_num : 0.0);
+
+    out_printf(out, "# HELP v4l2grab_stage_latency_seconds "
+            "Per-stage frame latency\n"
+            "# TYPE v4l2grab_stage_latency_seconds histogram\n");
+    for (i = 0; i < METRICS_STAGE_NR; i++)
+    {
+        render_histogram(out, &thiz->stages[i], stage_names[i]);
+    }
+
+    out_printf(out, "# HELP v4l2grab_stage_latency_quantile_seconds "
+            "Per-stage latency percentiles estimated from the histogram\n"
+            "# TYPE v4l2grab_stage_latency_quantile_seconds gauge\n");
+    for (i = 0; i < METRICS_STAGE_NR; i++)
+    {
+        unsigned long buckets[BUCKET_NR];
+        unsigned long count = 0;
+        size_t b;
+
+        for (b = 0; b < BUCKET_NR; b++)
+        {
+            buckets[b] = atomic_load_explicit(&thiz->stages[i].buckets[b],
+                    memory_order_relaxed);
+            count += buckets[b];
+        }
+
+        for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        {
+            double value = histogram_quantile(buckets, count, quantiles[q]);
+            char text[32];
+
+            /* printf spells it "nan", Prometheus wants "NaN" */
+            if (isnan(value))
+            {
+                strcpy(text, "NaN");
+            }
+            else
+            {
+                snprintf(text, sizeof(text), "%g", value / 1e6);
+            }
+
+            out_printf(out, "v4l2grab_stage_latency_quantile_seconds"
+                    "{stage=\"%s\",quantile=\"%g\"} %s\n",
+                    stage_names[i], quantiles[q], text);
+        }
+    }
+}
+
+static void serve(Metrics *thiz, int client)
+{
+    OutBuf *out;
+    char header[128];
+    char request[1024];
+    struct pollfd pfd = { client, POLLIN, 0 };
+    int n;
+
+    /* drain an HTTP request if the client sends one, but don't wait */
+    if (poll(&pfd, 1, 100) > 0)
+    {
+        n = read(client, request, sizeof(request));
+        (void)n;
+    }
+
+    out = malloc(sizeof(OutBuf));
+    if (out == NULL)
+    {
+        return;
+    }
+    out->size = 0;
+    render(thiz, out);
+    if (out->size > METRICS_BUF_SIZE - 1)
+    {
+        out->size = METRICS_BUF_SIZE - 1;
+    }
+
+    n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\n\r\n", out->size);
+    /* a client hanging up early must not SIGPIPE the grabber */
+    if (send(client, header, n, MSG_NOSIGNAL) == n)
+    {
+        send(client, out->data, out->size, MSG_NOSIGNAL);
+    }
+
+    free(out);
+}
+
+static void *metrics_thread(void *arg)
+{
+    Metrics *thiz = arg;
+    struct pollfd pfd = { thiz->fd, POLLIN, 0 };
+    int client;
+
+    while (!atomic_load(&thiz->quit))
+    {
+        if (poll(&pfd, 1, 200) <= 0)
+        {
+            continue;
+        }
+
+        client = accept(thiz->fd, NULL, NULL);
+        if (client >= 0)
+        {
+            serve(thiz, client);
+            close(client);
+        }
+    }
+
+    return NULL;
+}
+
+Metrics *metrics_create(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    Metrics *thiz;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Metrics socket path too long\n");
+        return NULL;
+    }
+
+    /* only a stale socket from a previous run may be replaced */
+    if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode))
+    {
+        fprintf(stderr, "%s exists and is not a socket\n", path);
+        return NULL;
+    }
+
+    thiz = calloc(1, sizeof(Metrics));
+    if (thiz == NULL)
+    {
+        return NULL;
+    }
+    strcpy(thiz->path, path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    thiz->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (thiz->fd < 0)
+    {
+        perror("metrics socket");
+        free(thiz);
+        return NULL;
+    }
+
+    /* a stale socket would make bind() fail */
+    unlink(path);
+    if (bind(thiz->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(thiz->fd, 4) != 0)
+    {
+        perror("metrics bind");
+        close(thiz->fd);
+        free(thiz);
+        return NULL;
+    }
+
+    if (pthread_create(&thiz->tid, NULL, metrics_thread, thiz) != 0)
+    {
+        close(thiz->fd);
+        unlink(path);
+        free(thiz);
+        return NULL;
+    }
+
+    return thiz;
+}
+
+void metrics_destroy(Metrics *thiz)
+{
+    if (thiz == NULL)
+    {
+        return;
+    }
+
+    atomic_store(&thiz->quit, 1);
+    pthread_join(thiz->tid, NULL);
+    close(thiz->fd);
+    unlink(thiz->path);
+    free(thiz);
+}
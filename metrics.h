@@ -0,0 +1,65 @@
+/**
+ * File: metrics.h
+ * Brief: Live counters published in Prometheus text format over a unix
+ *        socket. Updates are lock-free, a NULL Metrics is a no-op.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _Metrics;
+typedef struct _Metrics Metrics;
+
+typedef enum _MetricsCounter
+{
+    METRICS_FRAMES = 0,     /* frames dequeued from the driver */
+    METRICS_DROPPED,        /* gaps in the buffer sequence numbers */
+    METRICS_BYTES,          /* bytes written to disk */
+    METRICS_WRITER_FALLBACK,/* frames the workers had no room for */
+    METRICS_RECONNECTS,     /* capture restarts after a device loss */
+    METRICS_COUNTER_NR
+} MetricsCounter;
+
+typedef enum _MetricsGauge
+{
+    METRICS_BUFFERS = 0,    /* buffers allocated with the driver */
+    METRICS_BUFFERS_HELD,   /* buffers dequeued by us */
+    METRICS_WRITER_QUEUE,   /* outputs waiting for the writer threads */
+    METRICS_RECONNECT_MS,   /* duration of the last capture restart */
+    METRICS_GAUGE_NR
+} MetricsGauge;
+
+typedef enum _MetricsStage
+{
+    METRICS_STAGE_DEQUEUE = 0, /* driver timestamp to DQBUF */
+    METRICS_STAGE_DECODE,
+    METRICS_STAGE_OUTPUT,
+    METRICS_STAGE_NR
+} MetricsStage;
+
+/* Listen on the unix socket path and serve scrapes from a thread. */
+Metrics *metrics_create(const char *path);
+
+void metrics_count(Metrics *thiz, MetricsCounter counter, unsigned long n);
+void metrics_gauge_set(Metrics *thiz, MetricsGauge gauge, long value);
+void metrics_gauge_add(Metrics *thiz, MetricsGauge gauge, long delta);
+void metrics_latency(Metrics *thiz, MetricsStage stage, unsigned long usec);
+void metrics_format(Metrics *thiz, unsigned int pixelformat,
+        int width, int height, unsigned int fps_num, unsigned int fps_den);
+
+/* CLOCK_MONOTONIC in microseconds, the clock V4L2 timestamps use. */
+unsigned long metrics_now_us(void);
+
+void metrics_destroy(Metrics *thiz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,387 @@
+/**
+ * File: mosaic.c
+ * Brief: Many streams tiled in one SDL window through a single streaming
+ *        texture, decoded on worker threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#include "mosaic.h"
+
+#define MOSAIC_FORMAT       SDL_PIXELFORMAT_ARGB8888
+#define MOSAIC_MIN_FRAME_MS 8   /* in case the renderer ignores vsync */
+
+typedef struct _MosaicStream
+{
+    /* guarded by the mosaic lock */
+    unsigned char *pending;     /* compressed frame waiting for a decoder */
+    size_t pending_size;
+    int busy;                   /* a worker is decoding this stream */
+
+    /* guarded by the stream lock */
+    pthread_mutex_t lock;
+    SDL_Surface *back;          /* written by the decoding worker */
+    SDL_Surface *front;         /* latest complete tile */
+    int ready;
+
+    /* frames replaced before being decoded or before being shown */
+    atomic_ulong dropped;
+    unsigned long shown;        /* main thread only */
+    SDL_Rect rect;              /* tile inside the texture */
+} MosaicStream;
+
+struct _Mosaic
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int quit;
+    int next;                   /* round robin start for the workers */
+
+    int nstreams;
+    MosaicStream *streams;
+
+    int threads;
+    pthread_t *tids;
+
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    Uint32 last_present;
+};
+
+static MosaicStream *next_stream(Mosaic *thiz)
+{
+    int i;
+
+    for (i = 0; i < thiz->nstreams; i++)
+    {
+        int n = (thiz->next + i) % thiz->nstreams;
+        MosaicStream *s = &thiz->streams[n];
+
+        if (s->pending != NULL && !s->busy)
+        {
+            thiz->next = n + 1;
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+static int decode_tile(MosaicStream *s, unsigned char *data, size_t size)
+{
+    SDL_Surface *picture;
+    SDL_Surface *converted;
+    int ret;
+
+    picture = IMG_Load_RW(SDL_RWFromConstMem(data, size), 1);
+    if (picture == NULL)
+    {
+        return -1;
+    }
+
+    /* scaling blits want matching formats */
+    converted = SDL_ConvertSurfaceFormat(picture, MOSAIC_FORMAT, 0);
+    SDL_FreeSurface(picture);
+    if (converted == NULL)
+    {
+        return -1;
+    }
+
+    ret = SDL_BlitScaled(converted, NULL, s->back, NULL);
+    SDL_FreeSurface(converted);
+
+    return ret;
+}
+
+static void *mosaic_thread(void *arg)
+{
+    Mosaic *thiz = arg;
+    MosaicStream *s;
+    unsigned char *data;
+    size_t size;
+    SDL_Surface *tmp;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&thiz->lock);
+        while (!thiz->quit && (s = next_stream(thiz)) == NULL)
+        {
+            pthread_cond_wait(&thiz->work, &thiz->lock);
+        }
+
+        if (thiz->quit)
+        {
+            pthread_mutex_unlock(&thiz->lock);
+            break;
+        }
+
+        data = s->pending;
+        size = s->pending_size;
+        s->pending = NULL;
+        s->busy = 1;
+        pthread_mutex_unlock(&thiz->lock);
+
+        if (decode_tile(s, data, size) == 0)
+        {
+            pthread_mutex_lock(&s->lock);
+            /* the previous tile never made it to the screen */
+            if (s->ready)
+            {
+                atomic_fetch_add(&s->dropped, 1);
+            }
+            tmp = s->front;
+            s->front = s->back;
+            s->back = tmp;
+            s->ready = 1;
+            pthread_mutex_unlock(&s->lock);
+        }
+        free(data);
+
+        /* a frame may have arrived while we were busy */
+        pthread_mutex_lock(&thiz->lock);
+        s->busy = 0;
+        if (s->pending != NULL)
+        {
+            pthread_cond_signal(&thiz->work);
+        }
+        pthread_mutex_unlock(&thiz->lock);
+    }
+
+    return NULL;
+}
+
+void mosaic_push(Mosaic *thiz, int stream,
+        const void *header, size_t header_size,
+        const void *payload, size_t size)
+{
+    MosaicStream *s = &thiz->streams[stream];
+    unsigned char *data;
+    unsigned char *old;
+
+    data = malloc(header_size + size);
+    if (data == NULL)
+    {
+        return;
+    }
+
+    if (header_size)
+    {
+        memcpy(data, header, header_size);
+    }
+    memcpy(data + header_size, payload, size);
+
+    pthread_mutex_lock(&thiz->lock);
+    old = s->pending;
+    if (old != NULL)
+    {
+        atomic_fetch_add(&s->dropped, 1);
+    }
+    s->pending = data;
+    s->pending_size = header_size + size;
+    pthread_cond_signal(&thiz->work);
+    pthread_mutex_unlock(&thiz->lock);
+
+    free(old);
+}
+
+int mosaic_present(Mosaic *thiz)
+{
+    SDL_Event event;
+    Uint32 elapsed;
+    int quit = 0;
+    int i;
+
+    for (i = 0; i < thiz->nstreams; i++)
+    {
+        MosaicStream *s = &thiz->streams[i];
+
+        pthread_mutex_lock(&s->lock);
+        if (s->ready)
+        {
+            SDL_UpdateTexture(thiz->texture, &s->rect,
+                    s->front->pixels, s->front->pitch);
+            s->ready = 0;
+            s->shown++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    SDL_RenderClear(thiz->renderer);
+    SDL_RenderCopy(thiz->renderer, thiz->texture, NULL, NULL);
+    SDL_RenderPresent(thiz->renderer);
+
+    elapsed = SDL_GetTicks() - thiz->last_present;
+    if (elapsed < MOSAIC_MIN_FRAME_MS)
+    {
+        SDL_Delay(MOSAIC_MIN_FRAME_MS - elapsed);
+    }
+    thiz->last_present = SDL_GetTicks();
+
+    while (SDL_PollEvent(&event))
+    {
+        if (event.type == SDL_QUIT
+            || ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+                && event.key.keysym.sym == SDLK_ESCAPE))
+        {
+            quit = 1;
+        }
+    }
+
+    return quit;
+}
+
+Mosaic *mosaic_create(int streams, int tile_w, int tile_h, int decoders)
+{
+    int i;
+    int cols = 1;
+    int rows;
+    Mosaic *thiz = calloc(1, sizeof(Mosaic));
+
+    if (thiz == NULL)
+    {
+        return NULL;
+    }
+
+    /* as square a grid as possible */
+    while (cols * cols < streams)
+    {
+        cols++;
+    }
+    rows = (streams + cols - 1) / cols;
+
+    thiz->streams = calloc(streams, sizeof(MosaicStream));
+    thiz->tids = calloc(decoders, sizeof(pthread_t));
+    if (thiz->streams == NULL || thiz->tids == NULL)
+    {
+        free(thiz->streams);
+        free(thiz->tids);
+        free(thiz);
+        return NULL;
+    }
+
+    pthread_mutex_init(&thiz->lock, NULL);
+    pthread_cond_init(&thiz->work, NULL);
+
+    for (i = 0; i < streams; i++)
+    {
+        MosaicStream *s = &thiz->streams[i];
+
+        pthread_mutex_init(&s->lock, NULL);
+        s->rect.x = (i % cols) * tile_w;
+        s->rect.y = (i / cols) * tile_h;
+        s->rect.w = tile_w;
+        s->rect.h = tile_h;
+        s->back = SDL_CreateRGBSurfaceWithFormat(0, tile_w, tile_h, 32,
+                MOSAIC_FORMAT);
+        s->front = SDL_CreateRGBSurfaceWithFormat(0, tile_w, tile_h, 32,
+                MOSAIC_FORMAT);
+        thiz->nstreams++;
+
+        if (s->back == NULL || s->front == NULL)
+        {
+            mosaic_destroy(thiz);
+            return NULL;
+        }
+    }
+
+    thiz->window = SDL_CreateWindow("Video Show",
+            SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+            cols * tile_w, rows * tile_h, 0);
+    if (thiz->window != NULL)
+    {
+        thiz->renderer = SDL_CreateRenderer(thiz->window, -1,
+                SDL_RENDERER_PRESENTVSYNC);
+    }
+    if (thiz->renderer != NULL)
+    {
+        thiz->texture = SDL_CreateTexture(thiz->renderer, MOSAIC_FORMAT,
+                SDL_TEXTUREACCESS_STREAMING, cols * tile_w, rows * tile_h);
+    }
+    if (thiz->texture == NULL)
+    {
+        fprintf(stderr, "Cannot create mosaic window: %s\n", SDL_GetError());
+        mosaic_destroy(thiz);
+        return NULL;
+    }
+
+    for (i = 0; i < decoders; i++)
+    {
+        if (pthread_create(&thiz->tids[i], NULL, mosaic_thread, thiz) != 0)
+        {
+            break;
+        }
+    }
+    thiz->threads = i;
+
+    if (thiz->threads == 0)
+    {
+        mosaic_destroy(thiz);
+        return NULL;
+    }
+
+    return thiz;
+}
+
+void mosaic_destroy(Mosaic *thiz)
+{
+    int i;
+
+    if (thiz == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&thiz->lock);
+    thiz->quit = 1;
+    pthread_cond_broadcast(&thiz->work);
+    pthread_mutex_unlock(&thiz->lock);
+
+    for (i = 0; i < thiz->threads; i++)
+    {
+        pthread_join(thiz->tids[i], NULL);
+    }
+
+    for (i = 0; i < thiz->nstreams; i++)
+    {
+        MosaicStream *s = &thiz->streams[i];
+        unsigned long dropped = atomic_load(&s->dropped);
+
+        if (s->shown || dropped)
+        {
+            fprintf(stderr, "stream %d: %lu frames shown, %lu dropped\n",
+                    i, s->shown, dropped);
+        }
+
+        free(s->pending);
+        SDL_FreeSurface(s->back);
+        SDL_FreeSurface(s->front);
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    if (thiz->texture != NULL)
+    {
+        SDL_DestroyTexture(thiz->texture);
+    }
+    if (thiz->renderer != NULL)
+    {
+        SDL_DestroyRenderer(thiz->renderer);
+    }
+    if (thiz->window != NULL)
+    {
+        SDL_DestroyWindow(thiz->window);
+    }
+
+    pthread_cond_destroy(&thiz->work);
+    pthread_mutex_destroy(&thiz->lock);
+    free(thiz->streams);
+    free(thiz->tids);
+    free(thiz);
+}
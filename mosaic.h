@@ -0,0 +1,44 @@
+/**
+ * File: mosaic.h
+ * Brief: Many streams tiled in one SDL window through a single streaming
+ *        texture, decoded on worker threads.
+ */
+
+#ifndef _MOSAIC_H_
+#define _MOSAIC_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _Mosaic;
+typedef struct _Mosaic Mosaic;
+
+/* SDL video and SDL_image must be initialized by the caller. */
+Mosaic *mosaic_create(int streams, int tile_w, int tile_h, int decoders);
+
+/*
+ * Hand a JPEG frame (header + payload) of a stream to the decoders. It
+ * replaces a frame of the same stream still waiting to be decoded, so a
+ * slow stream only drops its own frames. Safe from any thread.
+ */
+void mosaic_push(Mosaic *thiz, int stream,
+        const void *header, size_t header_size,
+        const void *payload, size_t size);
+
+/*
+ * Upload the tiles decoded since the last call and present the window
+ * once. Must run on the thread that created the mosaic. Returns 1 when
+ * the user asked to quit.
+ */
+int mosaic_present(Mosaic *thiz);
+
+void mosaic_destroy(Mosaic *thiz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
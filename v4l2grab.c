@@ -16,8 +16,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -29,6 +32,9 @@
 
 #include "decoder.h"
 #include "decoder_mjpeg.h"
+#include "frame_writer.h"
+#include "metrics.h"
+#include "mosaic.h"
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -38,6 +44,24 @@
 #define TICK_INTERVAL    50
 #define IMG_DEFAULT_W   640
 #define IMG_DEFAULT_H   480
+#define WRITER_QUEUE_LEN  8  /* jobs waiting per worker thread */
+#define MAX_ROIS          8
+#define MAX_STREAMS      16  /* devices plus replays in the mosaic */
+#define MOSAIC_TILE_W   320
+#define MOSAIC_TILE_H   240
+#define REPLAY_INTERVAL_MS 40
+#define RECONNECT_MIN_MS  100
+#define RECONNECT_MAX_MS 5000
+#define RECONNECT_TRIES     5  /* for errors that don't look transient */
+#define SELECT_TIMEOUT_MS 2000
+#define STALL_FRAMES       10  /* frame periods without a frame to check */
+
+enum frame_status {
+    FRAME_OK,
+    FRAME_QUIT,
+    FRAME_LOST, /* device is gone, capture has to be restarted */
+    FRAME_ERROR, /* capture can't go on */
+};
 
 struct buffer {
     void *start;
@@ -51,11 +75,41 @@ struct v4l2grabber {
     int dry; /* 1 for display */
     int pix_width;
     int pix_height;
+    int optimize; /* threads re-encoding huffman tables, 0 to disable */
+    char *metrics_path; /* unix socket serving metrics, NULL to disable */
+    FrameRoi rois[MAX_ROIS]; /* regions saved as extra streams */
+    int n_rois;
+    int mosaic_mode; /* tile every device and replay in one window */
+    char *dev_names[MAX_STREAMS];
+    int n_devs;
+    char *replays[MAX_STREAMS]; /* printf patterns of images to replay */
+    int n_replays;
 
     int fd;
+    struct buffer *buffers;
+    unsigned int n_buffers;
+    unsigned int pixelformat;
+    unsigned int fps_num; /* timeperframe, 0 if unknown */
+    unsigned int fps_den;
+    unsigned int last_sequence;
+    int have_sequence;
     Decoder *decoder; /* MJPEG to JPEG converter */
+    FrameWriter *writer;
+    Metrics *metrics;
     SDL_Window *sdlWindow;
     SDL_Renderer *sdlRenderer;
+
+    /* set when capturing on a thread of its own for the mosaic */
+    Mosaic *mosaic;
+    int stream;
+    atomic_int *quit;
+};
+
+struct replay {
+    char *pattern;
+    int stream;
+    Mosaic *mosaic;
+    atomic_int *quit;
 };
 
 static void errno_exit(const char *s)
@@ -64,7 +118,7 @@ static void errno_exit(const char *s)
     exit(EXIT_FAILURE);
 }
 
-static void xioctl(int fh, int request, void *arg)
+static int xioctl(int fh, int request, void *arg)
 {
     int r;
 
@@ -72,10 +126,34 @@ static void xioctl(int fh, int request, void *arg)
         r = v4l2_ioctl(fh, request, arg);
     } while (r == -1 && ((errno == EINTR) || (errno == EAGAIN)));
 
+    /* callers classify the error, keep errno past the print */
     if (r == -1) {
-        fprintf(stderr, "error %d, %s\n", errno, strerror(errno));
-        exit(EXIT_FAILURE);
+        int err = errno;
+
+        fprintf(stderr, "error %d, %s\n", err, strerror(err));
+        errno = err;
     }
+
+    return r;
+}
+
+static int stopping(struct v4l2grabber *grabber)
+{
+    return grabber->quit && atomic_load(grabber->quit);
+}
+
+/* errors after which the device has to be opened again */
+static int device_lost(int err)
+{
+    return err == ENODEV || err == EIO || err == ENXIO;
+}
+
+/* errors worth retrying for as long as it takes while reconnecting */
+static int transient_error(int err)
+{
+    /* the node is missing or still owned by udev during re-enumeration */
+    return device_lost(err) || err == ENOENT || err == EBUSY
+           || err == EACCES;
 }
 
 Uint32 TimeLeft(void)
@@ -95,6 +173,7 @@ Uint32 TimeLeft(void)
 static void uninit(struct v4l2grabber *grabber)
 {
     decoder_destroy(grabber->decoder);
+    frame_writer_destroy(grabber->writer);
     if (grabber->dry) {
         SDL_DestroyRenderer(grabber->sdlRenderer);
         SDL_DestroyWindow(grabber->sdlWindow);
@@ -103,7 +182,8 @@ static void uninit(struct v4l2grabber *grabber)
     }
 }
 
-static void process_image(const void *ptr, size_t size, int i)
+static void process_image(const void *header, size_t header_size,
+                          const void *ptr, size_t size, int i)
 {
     char out_name[256];
     FILE *fout;
@@ -114,16 +194,40 @@ static void process_image(const void *ptr, size_t size, int i)
         perror("Cannot open image");
         exit(EXIT_FAILURE);
     }
+    if (header_size)
+        fwrite(header, header_size, 1, fout);
     fwrite(ptr, size, 1, fout);
     fclose(fout);
 }
 
+/* drain the window events, returns 1 when the user asked to quit */
+static int poll_quit(void)
+{
+    SDL_Event event;
+    int quit = 0;
+
+    while (SDL_PollEvent(&event)) {
+        switch (event.type) {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            if (event.key.keysym.sym == SDLK_ESCAPE)
+                quit = 1;
+            break;
+        case SDL_QUIT:
+            quit = 1;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return quit;
+}
+
 static int display_image(SDL_RWops *buffer_stream, SDL_Renderer *sdlRenderer)
 {
     SDL_Surface* picture;
     SDL_Texture *texture;
-    SDL_Event event;
-    int quit = 0;
 
     // Create a surface using the data coming out of the above stream.
     picture = IMG_Load_RW(buffer_stream, 1);
@@ -134,43 +238,76 @@ static int display_image(SDL_RWops *buffer_stream, SDL_Renderer *sdlRenderer)
     SDL_RenderPresent(sdlRenderer);
     SDL_Delay(TimeLeft());
 
-    // event poll
-    SDL_PollEvent(&event);
-    switch (event.type) {
-    case SDL_KEYDOWN:
-    case SDL_KEYUP:
-        if (event.key.keysym.sym == SDLK_ESCAPE)
-            quit = 1;
-        break;
-    case SDL_QUIT:
-        quit = 1;
-        break;
-    default:
-        break;
-    }
+    return poll_quit();
+}
 
-    return quit;
+static void account_frame(struct v4l2grabber *grabber,
+                          struct v4l2_buffer *buf)
+{
+    long lat;
+
+    metrics_count(grabber->metrics, METRICS_FRAMES, 1);
+    metrics_gauge_add(grabber->metrics, METRICS_BUFFERS_HELD, 1);
+
+    if (grabber->have_sequence && buf->sequence > grabber->last_sequence + 1)
+        metrics_count(grabber->metrics, METRICS_DROPPED,
+                      buf->sequence - grabber->last_sequence - 1);
+    grabber->last_sequence = buf->sequence;
+    grabber->have_sequence = 1;
+
+    /* only monotonic timestamps are comparable with our clock */
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+        == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        lat = metrics_now_us() - (buf->timestamp.tv_sec * 1000000L
+                                  + buf->timestamp.tv_usec);
+        if (lat >= 0)
+            metrics_latency(grabber->metrics, METRICS_STAGE_DEQUEUE, lat);
+    }
 }
 
-static int read_frame(struct v4l2grabber *grabber,
-                      struct buffer *buffers, int i)
+static int read_frame(struct v4l2grabber *grabber, int i)
 {
+    struct buffer *buffers = grabber->buffers;
     struct v4l2_buffer buf;
     int jpeg_size;
+    int offset;
     unsigned char *out_buf = NULL;
+    const unsigned char *header = NULL;
+    int header_size = 0;
+    FrameOutput outputs[1 + MAX_ROIS];
+    int n, queued;
     SDL_RWops* buffer_stream;
-    int quit = 0;
+    int status = FRAME_OK;
+    unsigned long t0, t1;
+    int r;
 
     CLEAR(buf);
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
-    xioctl(grabber->fd, VIDIOC_DQBUF, &buf);
-
-    jpeg_size = 0;
-    jpeg_size = decoder_decode(grabber->decoder, &out_buf,
+    if (xioctl(grabber->fd, VIDIOC_DQBUF, &buf) == -1)
+        return device_lost(errno) ? FRAME_LOST : FRAME_ERROR;
+    if (grabber->metrics)
+        account_frame(grabber, &buf);
+
+    t0 = metrics_now_us();
+    if (grabber->mosaic) {
+        /* the mosaic workers decode, just hand the frame over */
+        offset = decoder_split(grabber->decoder, &header, &header_size,
                                buffers[buf.index].start,
                                buf.bytesused);
-    if (grabber->dry) {
+        if (!offset)
+            header_size = 0;
+        t1 = metrics_now_us();
+
+        mosaic_push(grabber->mosaic, grabber->stream, header, header_size,
+                    (unsigned char *)buffers[buf.index].start + offset,
+                    buf.bytesused - offset);
+    } else if (grabber->dry) {
+        jpeg_size = decoder_decode(grabber->decoder, &out_buf,
+                                   buffers[buf.index].start,
+                                   buf.bytesused);
+        t1 = metrics_now_us();
+
         // Create a stream based on our buffer.
         if ( jpeg_size > 0 )
             buffer_stream = SDL_RWFromMem(out_buf, jpeg_size);
@@ -179,98 +316,116 @@ static int read_frame(struct v4l2grabber *grabber,
                                           buf.bytesused);
 
         if (display_image(buffer_stream, grabber->sdlRenderer))
-            quit = 1;
+            status = FRAME_QUIT;
+        free(out_buf);
     } else {
-        if ( jpeg_size > 0 ) {
-            process_image(out_buf, jpeg_size, i);
-            free(out_buf);
-        } else
-            process_image(buffers[buf.index].start, buf.bytesused, i);
-    }
-
-    xioctl(grabber->fd, VIDIOC_QBUF, &buf);
-
-    return quit;
-}
-
-static int mainloop(struct v4l2grabber *grabber, struct buffer *buffers)
-{
-    unsigned int i;
-    fd_set fds;
-    struct timeval tv;
-    int r;
-
-    /* main loop */
-    for (i = 0; i < grabber->frame_count; i++) {
-        do {
-            FD_ZERO(&fds);
-            FD_SET(grabber->fd, &fds);
-
-            /* Timeout. */
-            tv.tv_sec = 2;
-            tv.tv_usec = 0;
-
-            r = select(grabber->fd + 1, &fds, NULL, NULL, &tv);
-        } while ((r == -1 && (errno = EINTR)));
-        if (r == -1) {
-            perror("select");
-            return errno;
+        /* write the cached header and the scan straight from the mmap */
+        offset = decoder_split(grabber->decoder, &header, &header_size,
+                               buffers[buf.index].start,
+                               buf.bytesused);
+        if (!offset)
+            header_size = 0;
+        t1 = metrics_now_us();
+
+        n = 0;
+        if (grabber->optimize > 0) {
+            sprintf(outputs[n].name, "out%03d.jpg", i);
+            outputs[n++].roi = NULL;
+        }
+        for (r = 0; r < grabber->n_rois; r++) {
+            sprintf(outputs[n].name, "roi%d_%03d.jpg", r, i);
+            outputs[n++].roi = &grabber->rois[r];
         }
 
-        if (read_frame(grabber, buffers, i))
-            i = INT_MAX;
+        queued = grabber->writer
+                 && !frame_writer_submit(grabber->writer, outputs, n,
+                                         header, header_size,
+                                         (unsigned char *)
+                                         buffers[buf.index].start + offset,
+                                         buf.bytesused - offset);
+
+        /* save the original frame if the workers fall behind,
+           the regions of this frame are lost then */
+        if (grabber->writer && !queued)
+            metrics_count(grabber->metrics, METRICS_WRITER_FALLBACK, 1);
+        if (!queued || grabber->optimize <= 0) {
+            process_image(header, header_size,
+                          (unsigned char *)buffers[buf.index].start + offset,
+                          buf.bytesused - offset, i);
+            metrics_count(grabber->metrics, METRICS_BYTES,
+                          header_size + buf.bytesused - offset);
+        }
     }
+    metrics_latency(grabber->metrics, METRICS_STAGE_DECODE, t1 - t0);
+    metrics_latency(grabber->metrics, METRICS_STAGE_OUTPUT,
+                    metrics_now_us() - t1);
 
-    return 0;
+    metrics_gauge_add(grabber->metrics, METRICS_BUFFERS_HELD, -1);
+    /* a lost device shows up again at the next DQBUF */
+    if (xioctl(grabber->fd, VIDIOC_QBUF, &buf) == -1 && !device_lost(errno))
+        status = FRAME_ERROR;
+
+    return status;
 }
 
-static int init_mmap(int fd, struct buffer **buffers)
+static int init_mmap(struct v4l2grabber *grabber)
 {
     struct v4l2_requestbuffers req;
-    unsigned int i, n_buffers;
+    unsigned int i;
     struct v4l2_buffer buf;
+    struct buffer *buffers;
 
     CLEAR(req);
     req.count = 2;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
-    xioctl(fd, VIDIOC_REQBUFS, &req);
+    if (xioctl(grabber->fd, VIDIOC_REQBUFS, &req) == -1)
+        return -1;
 
-    *buffers = calloc(req.count, sizeof(**buffers));
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+    buffers = calloc(req.count, sizeof(*buffers));
+    if (!buffers)
+        return -1;
+    grabber->buffers = buffers;
+
+    for (; grabber->n_buffers < req.count; ++grabber->n_buffers) {
         CLEAR(buf);
 
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = n_buffers;
+        buf.index = grabber->n_buffers;
 
-        xioctl(fd, VIDIOC_QUERYBUF, &buf);
+        if (xioctl(grabber->fd, VIDIOC_QUERYBUF, &buf) == -1)
+            return -1;
 
-        (*buffers)[n_buffers].length = buf.length;
-        (*buffers)[n_buffers].start = v4l2_mmap(NULL, buf.length,
-                                                PROT_READ | PROT_WRITE,
-                                                MAP_SHARED, fd, buf.m.offset);
+        buffers[buf.index].length = buf.length;
+        buffers[buf.index].start = v4l2_mmap(NULL, buf.length,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, grabber->fd,
+                                             buf.m.offset);
 
-        if (MAP_FAILED == (*buffers)[n_buffers].start) {
+        if (MAP_FAILED == buffers[buf.index].start) {
             perror("mmap");
-            exit(EXIT_FAILURE);
+            buffers[buf.index].start = NULL;
+            return -1;
         }
     }
 
-    for (i = 0; i < n_buffers; ++i) {
+    for (i = 0; i < grabber->n_buffers; ++i) {
         CLEAR(buf);
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = i;
-        xioctl(fd, VIDIOC_QBUF, &buf);
+        if (xioctl(grabber->fd, VIDIOC_QBUF, &buf) == -1)
+            return -1;
     }
 
-    return n_buffers;
+    return 0;
 }
 
-static void init_device(struct v4l2grabber *grabber)
+static int init_device(struct v4l2grabber *grabber)
 {
     struct v4l2_format fmt;
+    struct v4l2_streamparm parm;
 
     CLEAR(fmt);
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -278,14 +433,17 @@ static void init_device(struct v4l2grabber *grabber)
     fmt.fmt.pix.height = grabber->pix_height;
     fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
     fmt.fmt.pix.field = V4L2_FIELD_NONE;
-    xioctl(grabber->fd, VIDIOC_S_FMT, &fmt);
+    if (xioctl(grabber->fd, VIDIOC_S_FMT, &fmt) == -1)
+        return -1;
     if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG) {
         printf("Libv4l didn't accept JPEG format. Trying MJPEG format.\n");
         fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-        xioctl(grabber->fd, VIDIOC_S_FMT, &fmt);
+        if (xioctl(grabber->fd, VIDIOC_S_FMT, &fmt) == -1)
+            return -1;
         if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG) {
             printf("Libv4l didn't accept MJPEG format. Can't proceed.\n");
-            exit(EXIT_FAILURE);
+            errno = EINVAL;
+            return -1;
         }
     }
     if ((fmt.fmt.pix.width != grabber->pix_width)
@@ -295,6 +453,399 @@ static void init_device(struct v4l2grabber *grabber)
         grabber->pix_width = fmt.fmt.pix.width;
         grabber->pix_height = fmt.fmt.pix.height;
     }
+    grabber->pixelformat = fmt.fmt.pix.pixelformat;
+
+    /* the frame rate is informational, not every driver reports it */
+    CLEAR(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (v4l2_ioctl(grabber->fd, VIDIOC_G_PARM, &parm) == -1)
+        CLEAR(parm);
+    grabber->fps_num = parm.parm.capture.timeperframe.numerator;
+    grabber->fps_den = parm.parm.capture.timeperframe.denominator;
+    metrics_format(grabber->metrics, grabber->pixelformat,
+                   grabber->pix_width, grabber->pix_height,
+                   grabber->fps_num, grabber->fps_den);
+
+    return 0;
+}
+
+/* open the device and stream with the negotiated format */
+static int start_capture(struct v4l2grabber *grabber)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    grabber->fd = v4l2_open(grabber->dev_name, O_RDWR | O_NONBLOCK, 0);
+    if (grabber->fd < 0) {
+        int err = errno;
+
+        perror("Cannot open device");
+        errno = err;
+        return -1;
+    }
+
+    if (init_device(grabber) || init_mmap(grabber)
+        || xioctl(grabber->fd, VIDIOC_STREAMON, &type) == -1)
+        return -1;
+
+    metrics_gauge_set(grabber->metrics, METRICS_BUFFERS, grabber->n_buffers);
+    grabber->have_sequence = 0;
+
+    return 0;
+}
+
+static void stop_capture(struct v4l2grabber *grabber)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int i;
+
+    if (grabber->fd < 0)
+        return;
+
+    /* fails if the device is already gone, which is fine */
+    v4l2_ioctl(grabber->fd, VIDIOC_STREAMOFF, &type);
+    for (i = 0; i < grabber->n_buffers; ++i)
+        if (grabber->buffers[i].start)
+            v4l2_munmap(grabber->buffers[i].start,
+                        grabber->buffers[i].length);
+    free(grabber->buffers);
+    grabber->buffers = NULL;
+    grabber->n_buffers = 0;
+    v4l2_close(grabber->fd);
+    grabber->fd = -1;
+
+    metrics_gauge_set(grabber->metrics, METRICS_BUFFERS, 0);
+    metrics_gauge_set(grabber->metrics, METRICS_BUFFERS_HELD, 0);
+}
+
+/* sleep between reconnect attempts, returns 1 if we should stop */
+static int retry_wait(struct v4l2grabber *grabber, unsigned int ms)
+{
+    unsigned int waited;
+
+    /* keep the window responsive and the shutdown quick meanwhile */
+    for (waited = 0; waited < ms; waited += TICK_INTERVAL) {
+        if (stopping(grabber) || (grabber->dry && poll_quit()))
+            return 1;
+        usleep(TICK_INTERVAL * 1000);
+    }
+
+    return 0;
+}
+
+/*
+ * Restart capture in place, e.g. after a USB re-enumeration. The decoder,
+ * the writers and the display are kept. Transient errors are retried
+ * until the device is back, others only a few times.
+ */
+static int reconnect(struct v4l2grabber *grabber)
+{
+    unsigned long start = metrics_now_us();
+    unsigned long elapsed, lost = 0;
+    unsigned int delay = RECONNECT_MIN_MS;
+    int failures = 0;
+    int err;
+
+    fprintf(stderr, "Lost %s, restarting capture\n", grabber->dev_name);
+
+    stop_capture(grabber);
+    while (start_capture(grabber)) {
+        err = errno;
+        stop_capture(grabber);
+        if (!transient_error(err) && ++failures == RECONNECT_TRIES) {
+            fprintf(stderr, "Giving up on %s: %s\n", grabber->dev_name,
+                    strerror(err));
+            return FRAME_ERROR;
+        }
+        if (retry_wait(grabber, delay))
+            return FRAME_QUIT;
+        delay = delay * 2 > RECONNECT_MAX_MS ? RECONNECT_MAX_MS : delay * 2;
+    }
+
+    /* nothing was dequeued meanwhile, estimate the loss from the rate */
+    elapsed = (metrics_now_us() - start) / 1000;
+    if (grabber->fps_num)
+        lost = elapsed * grabber->fps_den / (grabber->fps_num * 1000UL);
+
+    fprintf(stderr, "Reconnected %s after %lu ms, about %lu frames lost\n",
+            grabber->dev_name, elapsed, lost);
+    metrics_count(grabber->metrics, METRICS_RECONNECTS, 1);
+    metrics_count(grabber->metrics, METRICS_DROPPED, lost);
+    metrics_gauge_set(grabber->metrics, METRICS_RECONNECT_MS, elapsed);
+
+    return FRAME_OK;
+}
+
+/* how long a stream may go without a frame before the device is probed */
+static unsigned long stall_ms(struct v4l2grabber *grabber)
+{
+    unsigned long ms = 0;
+
+    if (grabber->fps_den)
+        ms = STALL_FRAMES * 1000UL * grabber->fps_num / grabber->fps_den;
+
+    return ms > SELECT_TIMEOUT_MS ? ms : SELECT_TIMEOUT_MS;
+}
+
+/* a slow or triggered camera is quiet, not gone: ask the driver */
+static int device_gone(struct v4l2grabber *grabber)
+{
+    struct v4l2_format fmt;
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    return v4l2_ioctl(grabber->fd, VIDIOC_G_FMT, &fmt) == -1
+           && device_lost(errno);
+}
+
+static int mainloop(struct v4l2grabber *grabber)
+{
+    unsigned int i = 0;
+    unsigned long stalled = 0;
+    /* short waits when displaying, so the window keeps handling events */
+    unsigned int wait_ms = grabber->dry ? TICK_INTERVAL : SELECT_TIMEOUT_MS;
+    fd_set fds;
+    struct timeval tv;
+    int status;
+    int r;
+
+    /* main loop */
+    while (i < grabber->frame_count && !stopping(grabber)) {
+        do {
+            FD_ZERO(&fds);
+            FD_SET(grabber->fd, &fds);
+
+            /* Timeout. */
+            tv.tv_sec = wait_ms / 1000;
+            tv.tv_usec = wait_ms % 1000 * 1000;
+
+            r = select(grabber->fd + 1, &fds, NULL, NULL, &tv);
+        } while ((r == -1 && (errno == EINTR)));
+        if (r == -1) {
+            perror("select");
+            return errno;
+        }
+
+        if (r == 0) {
+            if (grabber->dry && poll_quit())
+                break;
+
+            stalled += wait_ms;
+            if (stalled < stall_ms(grabber))
+                continue;
+            stalled = 0;
+
+            if (!device_gone(grabber)) {
+                fprintf(stderr, "No frame from %s for %lu ms\n",
+                        grabber->dev_name, stall_ms(grabber));
+                continue;
+            }
+            status = FRAME_LOST;
+        } else {
+            stalled = 0;
+            status = read_frame(grabber, i);
+            if (status == FRAME_OK)
+                i++;
+        }
+
+        if (status == FRAME_LOST)
+            status = reconnect(grabber);
+        if (status == FRAME_QUIT)
+            break;
+        if (status == FRAME_ERROR)
+            return EXIT_FAILURE;
+    }
+
+    return 0;
+}
+
+static void *capture_thread(void *arg)
+{
+    struct v4l2grabber *grabber = arg;
+
+    /* a camera missing at launch is waited for like a lost one */
+    if (grabber->fd < 0 && reconnect(grabber) != FRAME_OK)
+        return NULL;
+
+    /* only this tile freezes, the rest of the wall goes on */
+    if (mainloop(grabber))
+        fprintf(stderr, "Stopped capturing %s\n", grabber->dev_name);
+
+    return NULL;
+}
+
+static unsigned char *load_file(const char *name, size_t *size)
+{
+    FILE *fin;
+    unsigned char *data = NULL;
+    long len;
+
+    fin = fopen(name, "r");
+    if (!fin)
+        return NULL;
+
+    if (fseek(fin, 0, SEEK_END) == 0 && (len = ftell(fin)) > 0) {
+        rewind(fin);
+        data = malloc(len);
+        if (data && fread(data, len, 1, fin) != 1) {
+            free(data);
+            data = NULL;
+        }
+        *size = len;
+    }
+    fclose(fin);
+
+    return data;
+}
+
+/* feed out%03d.jpg style image sequences to the mosaic, looping */
+static void *replay_thread(void *arg)
+{
+    struct replay *replay = arg;
+    char name[PATH_MAX];
+    unsigned char *data;
+    size_t size;
+    int i = 0;
+
+    while (!atomic_load(replay->quit)) {
+        snprintf(name, sizeof(name), replay->pattern, i++);
+        data = load_file(name, &size);
+        if (!data) {
+            if (i == 1) {
+                fprintf(stderr, "Cannot replay %s\n", name);
+                break;
+            }
+            i = 0;
+            continue;
+        }
+
+        mosaic_push(replay->mosaic, replay->stream, NULL, 0, data, size);
+        free(data);
+        usleep(REPLAY_INTERVAL_MS * 1000);
+    }
+
+    return NULL;
+}
+
+static int run_mosaic(struct v4l2grabber *config)
+{
+    struct v4l2grabber grabbers[MAX_STREAMS];
+    struct replay replays[MAX_STREAMS];
+    pthread_t tids[MAX_STREAMS * 2];
+    int n_tids = 0;
+    int streams, decoders, i;
+    atomic_int quit = 0;
+    Mosaic *mosaic;
+
+    if (!config->n_devs && !config->n_replays)
+        config->dev_names[config->n_devs++] = config->dev_name;
+    streams = config->n_devs + config->n_replays;
+
+    SDL_Init(SDL_INIT_VIDEO);
+    IMG_Init(IMG_INIT_JPG);
+
+    /* a decoder per stream at most, a slow one only stalls itself */
+    decoders = sysconf(_SC_NPROCESSORS_ONLN);
+    if (decoders < 1 || decoders > streams)
+        decoders = streams;
+
+    mosaic = mosaic_create(streams, MOSAIC_TILE_W, MOSAIC_TILE_H, decoders);
+    if (!mosaic) {
+        IMG_Quit();
+        SDL_Quit();
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < config->n_devs; i++) {
+        struct v4l2grabber *grabber = &grabbers[i];
+
+        *grabber = *config;
+        grabber->dev_name = config->dev_names[i];
+        grabber->frame_count = INT_MAX;
+        grabber->dry = 0;
+        grabber->writer = NULL;
+        grabber->mosaic = mosaic;
+        grabber->stream = i;
+        grabber->quit = &quit;
+
+        /* the capture thread keeps retrying a camera missing now */
+        if (start_capture(grabber))
+            stop_capture(grabber);
+
+        grabber->decoder = decoder_mjpeg_create();
+        if (pthread_create(&tids[n_tids], NULL,
+                           capture_thread, grabber) == 0)
+            n_tids++;
+    }
+
+    for (i = 0; i < config->n_replays; i++) {
+        replays[i].pattern = config->replays[i];
+        replays[i].stream = config->n_devs + i;
+        replays[i].mosaic = mosaic;
+        replays[i].quit = &quit;
+        if (pthread_create(&tids[n_tids], NULL,
+                           replay_thread, &replays[i]) == 0)
+            n_tids++;
+    }
+
+    /* one upload and present per vsync for the whole wall */
+    while (!mosaic_present(mosaic))
+        ;
+
+    atomic_store(&quit, 1);
+    for (i = 0; i < n_tids; i++)
+        pthread_join(tids[i], NULL);
+
+    for (i = 0; i < config->n_devs; i++) {
+        stop_capture(&grabbers[i]);
+        decoder_destroy(grabbers[i].decoder);
+    }
+
+    mosaic_destroy(mosaic);
+    IMG_Quit();
+    SDL_Quit();
+
+    return 0;
+}
+
+/* a replay pattern is a printf format taking the frame number only */
+static int check_pattern(const char *fmt)
+{
+    int conversions = 0;
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%')
+            continue;
+        if (*++fmt == '%')
+            continue;
+        while (*fmt >= '0' && *fmt <= '9')
+            fmt++;
+        if (*fmt != 'd')
+            return -1;
+        conversions++;
+    }
+
+    return conversions == 1 ? 0 : -1;
+}
+
+/* regions have to fit the frame size the driver settled on */
+static int check_rois(struct v4l2grabber *grabber)
+{
+    FrameRoi *roi;
+    int r;
+
+    for (r = 0; r < grabber->n_rois; r++) {
+        roi = &grabber->rois[r];
+        if (roi->x + roi->w > grabber->pix_width
+            || roi->y + roi->h > grabber->pix_height) {
+            fprintf(stderr, "Region %dx%d+%d+%d is outside the %dx%d frame\n",
+                    roi->w, roi->h, roi->x, roi->y,
+                    grabber->pix_width, grabber->pix_height);
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
 static void usage(FILE *fp, int argc, char **argv)
@@ -306,11 +857,20 @@ static void usage(FILE *fp, int argc, char **argv)
             "-h | --help          Print this message\n"
             "-c | --count         Number of frames to grab [3]\n"
             "-n | --dry           Don't save images but display them\n"
+            "-o | --optimize      Threads optimizing huffman tables of saved\n"
+            "                     images [0]\n"
+            "-m | --metrics path  Serve Prometheus metrics on a unix socket\n"
+            "-r | --roi WxH+X+Y   Also save a region cut at MCU boundaries,\n"
+            "                     may be repeated\n"
+            "-M | --mosaic        Display every -d device and -F replay\n"
+            "                     tiled in one window until it is closed\n"
+            "-F | --replay fmt    Replay images named like out%%03d.jpg in\n"
+            "                     the mosaic, may be repeated\n"
             "",
             argv[0]);
 }
 
-static const char short_options[] = "d:hc:n";
+static const char short_options[] = "d:hc:no:m:r:MF:";
 
 static const struct option
 long_options[] = {
@@ -318,6 +878,11 @@ long_options[] = {
         { "help",   no_argument,       NULL, 'h' },
         { "count",  required_argument, NULL, 'c' },
         { "dry",    no_argument,       NULL, 'n' },
+        { "optimize", required_argument, NULL, 'o' },
+        { "metrics", required_argument, NULL, 'm' },
+        { "roi",    required_argument, NULL, 'r' },
+        { "mosaic", no_argument,       NULL, 'M' },
+        { "replay", required_argument, NULL, 'F' },
         { 0, 0, 0, 0 }
 };
 
@@ -325,10 +890,18 @@ static void parse_options(int argc, char **argv, struct v4l2grabber *grabber)
 {
     int idx;
     int c;
+    int count_given = 0;
+    FrameRoi *roi;
 
     grabber->dev_name = "/dev/video0";
     grabber->frame_count = 3;
     grabber->dry = 0;
+    grabber->optimize = 0;
+    grabber->metrics_path = NULL;
+    grabber->n_rois = 0;
+    grabber->mosaic_mode = 0;
+    grabber->n_devs = 0;
+    grabber->n_replays = 0;
     grabber->pix_width = IMG_DEFAULT_W;
     grabber->pix_height = IMG_DEFAULT_H;
 
@@ -346,6 +919,11 @@ static void parse_options(int argc, char **argv, struct v4l2grabber *grabber)
 
         case 'd':
             grabber->dev_name = optarg;
+            if (grabber->n_devs + grabber->n_replays == MAX_STREAMS) {
+                fprintf(stderr, "Too many streams\n");
+                exit(EXIT_FAILURE);
+            }
+            grabber->dev_names[grabber->n_devs++] = optarg;
             break;
 
         case 'h':
@@ -357,45 +935,129 @@ static void parse_options(int argc, char **argv, struct v4l2grabber *grabber)
             grabber->frame_count = strtol(optarg, NULL, 0);
             if (errno)
                 errno_exit(optarg);
+            count_given = 1;
             break;
 
         case 'n':
             grabber->dry = 1;
             break;
 
+        case 'o':
+            errno = 0;
+            grabber->optimize = strtol(optarg, NULL, 0);
+            if (errno)
+                errno_exit(optarg);
+            break;
+
+        case 'm':
+            grabber->metrics_path = optarg;
+            break;
+
+        case 'r':
+            roi = &grabber->rois[grabber->n_rois];
+            if (grabber->n_rois == MAX_ROIS
+                || sscanf(optarg, "%dx%d+%d+%d",
+                          &roi->w, &roi->h, &roi->x, &roi->y) != 4
+                || roi->w <= 0 || roi->h <= 0 || roi->x < 0 || roi->y < 0) {
+                fprintf(stderr, "Bad or too many regions: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            grabber->n_rois++;
+            break;
+
+        case 'M':
+            grabber->mosaic_mode = 1;
+            break;
+
+        case 'F':
+            if (grabber->n_devs + grabber->n_replays == MAX_STREAMS) {
+                fprintf(stderr, "Too many streams\n");
+                exit(EXIT_FAILURE);
+            }
+            if (check_pattern(optarg)) {
+                fprintf(stderr, "Replay pattern needs one %%d or %%0Nd: %s\n",
+                        optarg);
+                exit(EXIT_FAILURE);
+            }
+            grabber->replays[grabber->n_replays++] = optarg;
+            break;
+
         default:
             usage(stderr, argc, argv);
             exit(EXIT_FAILURE);
         }
     }
+
+    if (grabber->n_rois && (grabber->dry || grabber->mosaic_mode)) {
+        fprintf(stderr, "Regions are only saved, not displayed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the metrics describe a single device */
+    if (grabber->metrics_path && grabber->mosaic_mode) {
+        fprintf(stderr, "Metrics are not available with --mosaic\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the mosaic displays until closed and never saves */
+    if (grabber->mosaic_mode
+        && (count_given || grabber->optimize || grabber->dry)) {
+        fprintf(stderr, "--count, --optimize and --dry don't apply to "
+                "--mosaic\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 int main(int argc, char **argv)
 {
-    enum v4l2_buf_type type;
     int r = 0;
-    unsigned int i, n_buffers;
-    struct buffer *buffers;
+    int threads;
 
     struct v4l2grabber grabber;
 
     grabber.fd = -1;
+    grabber.buffers = NULL;
+    grabber.n_buffers = 0;
+    grabber.have_sequence = 0;
+    grabber.fps_num = 0;
+    grabber.fps_den = 0;
+    grabber.mosaic = NULL;
+    grabber.quit = NULL;
     parse_options(argc, argv, &grabber);
 
-    grabber.fd = v4l2_open(grabber.dev_name, O_RDWR | O_NONBLOCK, 0);
-    if (grabber.fd < 0) {
-        perror("Cannot open device");
-        exit(EXIT_FAILURE);
+    grabber.metrics = NULL;
+    if (grabber.metrics_path) {
+        grabber.metrics = metrics_create(grabber.metrics_path);
+        if (!grabber.metrics)
+            exit(EXIT_FAILURE);
     }
 
-    init_device(&grabber);
-    n_buffers = init_mmap(grabber.fd, &buffers);
+    if (grabber.mosaic_mode) {
+        r = run_mosaic(&grabber);
+        metrics_destroy(grabber.metrics);
+        return r;
+    }
 
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    xioctl(grabber.fd, VIDIOC_STREAMON, &type);
+    if (start_capture(&grabber) || check_rois(&grabber)) {
+        stop_capture(&grabber);
+        metrics_destroy(grabber.metrics);
+        exit(EXIT_FAILURE);
+    }
 
     grabber.decoder = decoder_mjpeg_create();
 
+    grabber.writer = NULL;
+    /* without -o, one worker per region */
+    threads = grabber.optimize > 0 ? grabber.optimize : grabber.n_rois;
+    if (!grabber.dry && threads > 0) {
+        grabber.writer = frame_writer_create(threads,
+                                             (threads + grabber.n_rois) *
+                                             WRITER_QUEUE_LEN,
+                                             grabber.metrics);
+        if (!grabber.writer)
+            fprintf(stderr, "Cannot start writer threads\n");
+    }
+
     /* initiate display */
     if (grabber.dry) {
         grabber.frame_count = INT_MAX;
@@ -412,14 +1074,11 @@ int main(int argc, char **argv)
         grabber.sdlRenderer = SDL_CreateRenderer(grabber.sdlWindow, -1, 0);
     }
 
-    r = mainloop(&grabber, buffers);
+    r = mainloop(&grabber);
 
     uninit(&grabber);
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    xioctl(grabber.fd, VIDIOC_STREAMOFF, &type);
-    for (i = 0; i < n_buffers; ++i)
-        v4l2_munmap(buffers[i].start, buffers[i].length);
-    v4l2_close(grabber.fd);
+    stop_capture(&grabber);
+    metrics_destroy(grabber.metrics);
 
     return r;
 }